@@ -5,9 +5,11 @@
 #include "defs.h"
 #include "spinlock.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ethernet.h"
 #include "arp.h"
 #include "ip.h"
+#include "timer.h"
 
 #define ARP_HRD_ETHERNET 0x0001
 
@@ -16,6 +18,7 @@
 
 #define ARP_TABLE_SIZE 4096
 #define ARP_TABLE_TIMEOUT_SEC 300
+#define ARP_TABLE_PATROL_SEC 10
 
 #define DEBUG
 
@@ -48,6 +51,7 @@ struct arp_entry {
 static struct spinlock arplock;
 static struct arp_entry arp_table[ARP_TABLE_SIZE];
 static time_t timestamp;
+static struct timer arp_timer;
 
 static char *
 arp_opcode_ntop (uint16_t opcode) {
@@ -128,8 +132,7 @@ arp_table_update (struct netdev *dev, const ip_addr_t *pa, const uint8_t *ha) {
             /* warning: receive response from unintended device */
             dev = entry->netif->dev;
         }
-        dev->ops->xmit(dev, ETHERNET_TYPE_IP, (uint8_t *)entry->data, entry->len, entry->ha);
-        kfree(entry->data);
+        dev->ops->xmit(dev, ETHERNET_TYPE_IP, (struct pbuf *)entry->data, entry->ha);
         entry->data = NULL;
         entry->len = 0;
     }
@@ -174,7 +177,7 @@ arp_entry_clear (struct arp_entry *entry) {
     memset(entry->ha, 0, ETHERNET_ADDR_LEN);
     //entry->timestamp = 0;
     if (entry->data) {
-        kfree(entry->data);
+        pbuf_free((struct pbuf *)entry->data);
         entry->data = NULL;
         entry->len = 0;
     }
@@ -194,27 +197,42 @@ arp_table_patrol (void) {
     }
 }
 
+static void
+arp_patrol_timeout (void *arg) {
+    acquire(&arplock);
+    time(&timestamp);
+    arp_table_patrol();
+    release(&arplock);
+    timer_arm(&arp_timer, MSEC2TICKS(ARP_TABLE_PATROL_SEC * 1000));
+}
+
 static int
 arp_send_request (struct netif *netif, const ip_addr_t *tpa) {
-    struct arp_ethernet request;
+    struct pbuf *pb;
+    struct arp_ethernet *request;
 
     if (!tpa) {
         return -1;
     }
-    request.hdr.hrd = hton16(ARP_HRD_ETHERNET);
-    request.hdr.pro = hton16(ETHERNET_TYPE_IP);
-    request.hdr.hln = ETHERNET_ADDR_LEN;
-    request.hdr.pln = IP_ADDR_LEN;
-    request.hdr.op = hton16(ARP_OP_REQUEST);
-    memcpy(request.sha, netif->dev->addr, ETHERNET_ADDR_LEN);
-    request.spa = ((struct netif_ip *)netif)->unicast;
-    memset(request.tha, 0, ETHERNET_ADDR_LEN);
-    request.tpa = *tpa;
+    pb = pbuf_alloc();
+    if (!pb) {
+        return -1;
+    }
+    request = (struct arp_ethernet *)pbuf_put(pb, sizeof(*request));
+    request->hdr.hrd = hton16(ARP_HRD_ETHERNET);
+    request->hdr.pro = hton16(ETHERNET_TYPE_IP);
+    request->hdr.hln = ETHERNET_ADDR_LEN;
+    request->hdr.pln = IP_ADDR_LEN;
+    request->hdr.op = hton16(ARP_OP_REQUEST);
+    memcpy(request->sha, netif->dev->addr, ETHERNET_ADDR_LEN);
+    request->spa = ((struct netif_ip *)netif)->unicast;
+    memset(request->tha, 0, ETHERNET_ADDR_LEN);
+    request->tpa = *tpa;
 #ifdef DEBUG
     cprintf(">>> arp_send_request <<<\n");
-    arp_dump((uint8_t *)&request, sizeof(request));
+    arp_dump(pb->data, pb->len);
 #endif
-    if (netif->dev->ops->xmit(netif->dev, ETHERNET_TYPE_ARP, (uint8_t *)&request, sizeof(request), ETHERNET_ADDR_BROADCAST) == -1) {
+    if (netif->dev->ops->xmit(netif->dev, ETHERNET_TYPE_ARP, pb, ETHERNET_ADDR_BROADCAST) == -1) {
         return -1;
     }
     return 0;
@@ -222,68 +240,68 @@ arp_send_request (struct netif *netif, const ip_addr_t *tpa) {
 
 static int
 arp_send_reply (struct netif *netif, const uint8_t *tha, const ip_addr_t *tpa, const uint8_t *dst) {
-    struct arp_ethernet reply;
+    struct pbuf *pb;
+    struct arp_ethernet *reply;
 
     if (!tha || !tpa) {
         return -1;
     }
-    reply.hdr.hrd = hton16(ARP_HRD_ETHERNET);
-    reply.hdr.pro = hton16(ETHERNET_TYPE_IP);
-    reply.hdr.hln = ETHERNET_ADDR_LEN;
-    reply.hdr.pln = IP_ADDR_LEN;
-    reply.hdr.op = hton16(ARP_OP_REPLY);
-    memcpy(reply.sha, netif->dev->addr, ETHERNET_ADDR_LEN);
-    reply.spa = ((struct netif_ip *)netif)->unicast;
-    memcpy(reply.tha, tha, ETHERNET_ADDR_LEN);
-    reply.tpa = *tpa;
+    pb = pbuf_alloc();
+    if (!pb) {
+        return -1;
+    }
+    reply = (struct arp_ethernet *)pbuf_put(pb, sizeof(*reply));
+    reply->hdr.hrd = hton16(ARP_HRD_ETHERNET);
+    reply->hdr.pro = hton16(ETHERNET_TYPE_IP);
+    reply->hdr.hln = ETHERNET_ADDR_LEN;
+    reply->hdr.pln = IP_ADDR_LEN;
+    reply->hdr.op = hton16(ARP_OP_REPLY);
+    memcpy(reply->sha, netif->dev->addr, ETHERNET_ADDR_LEN);
+    reply->spa = ((struct netif_ip *)netif)->unicast;
+    memcpy(reply->tha, tha, ETHERNET_ADDR_LEN);
+    reply->tpa = *tpa;
 #ifdef DEBUG
     cprintf(">>> arp_send_reply <<<\n");
-    arp_dump((uint8_t *)&reply, sizeof(reply));
+    arp_dump(pb->data, pb->len);
 #endif
-    if (netif->dev->ops->xmit(netif->dev, ETHERNET_TYPE_ARP, (uint8_t *)&reply, sizeof(reply), dst) < 0) {
+    if (netif->dev->ops->xmit(netif->dev, ETHERNET_TYPE_ARP, pb, dst) < 0) {
         return -1;
     }
     return 0;
 }
 
 static void
-arp_rx (uint8_t *packet, size_t plen, struct netdev *dev) {
+arp_rx (struct pbuf *pb, struct netdev *dev) {
     struct arp_ethernet *message;
-    time_t now;
     int marge = 0;
     struct netif *netif;
 
-    if (plen < sizeof(struct arp_ethernet)) {
+    if (pb->len < sizeof(struct arp_ethernet)) {
         cprintf("ISSUE1\n");
-        return;
+        goto out;
     }
-    message = (struct arp_ethernet *)packet;
+    message = (struct arp_ethernet *)pb->data;
     if (ntoh16(message->hdr.hrd) != ARP_HRD_ETHERNET) {
         cprintf("ISSUE2\n");
-        return;
+        goto out;
     }
     if (ntoh16(message->hdr.pro) != ETHERNET_TYPE_IP) {
         cprintf("ISSUE3\n");
-        return;
+        goto out;
     }
     if (message->hdr.hln != ETHERNET_ADDR_LEN) {
         cprintf("ISSUE4\n");
-        return;
+        goto out;
     }
     if (message->hdr.pln != IP_ADDR_LEN) {
         cprintf("ISSUE5\n");
-        return;
+        goto out;
     }
 #ifdef DEBUG
     cprintf(">>> arp_rx <<<\n");
-    arp_dump(packet, plen);
+    arp_dump(pb->data, pb->len);
 #endif
     acquire(&arplock);
-    time(&now);
-    if (now - timestamp > 10) {
-        timestamp = now;
-        arp_table_patrol();
-    }
     marge = (arp_table_update(dev, &message->spa, message->sha) == 0) ? 1 : 0;
     release(&arplock);
     netif = netdev_get_netif(dev, NETIF_FAMILY_IPV4);
@@ -298,7 +316,8 @@ arp_rx (uint8_t *packet, size_t plen, struct netdev *dev) {
             arp_send_reply(netif, message->sha, &message->spa, message->sha);
         }
     }
-    return;
+out:
+    pbuf_free(pb);
 }
 
 int
@@ -481,6 +500,8 @@ arp_init (void) {
 
     time(&timestamp);
     initlock(&arplock, "arp");
+    timer_init(&arp_timer, arp_patrol_timeout, NULL);
+    timer_arm(&arp_timer, MSEC2TICKS(ARP_TABLE_PATROL_SEC * 1000));
     netproto_register(NETPROTO_TYPE_ARP, arp_rx);
     return 0;
 }
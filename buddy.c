@@ -0,0 +1,155 @@
+// Buddy allocator for physically contiguous runs of pages.
+//
+// kalloc() hands out single pages.  Descriptor rings, jumbo buffers
+// and large socket buffers need 2^order contiguous pages, so kinit1
+// and kinit2 set aside part of physical memory for this allocator.
+//
+// Free blocks of each order sit on a doubly linked list.  For every
+// physical page, state[] holds order+1 if a free block starts there
+// and 0 otherwise, which is all a free needs to find and merge with
+// its buddy.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+struct {
+  struct spinlock lock;
+  int use_lock;
+  struct block *free[BUDDY_MAX_ORDER+1];
+  uchar state[PHYSTOP/PGSIZE];
+} buddy;
+
+static void
+block_push(struct block *b, int order)
+{
+  b->prev = 0;
+  b->next = buddy.free[order];
+  if(b->next)
+    b->next->prev = b;
+  buddy.free[order] = b;
+  buddy.state[V2P(b)/PGSIZE] = order + 1;
+}
+
+static void
+block_remove(struct block *b, int order)
+{
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    buddy.free[order] = b->next;
+  if(b->next)
+    b->next->prev = b->prev;
+  buddy.state[V2P(b)/PGSIZE] = 0;
+}
+
+// Give [vstart, vend) to the buddy allocator. Called from kinit1
+// and kinit2 before locking is turned on.
+void
+buddyinit(void *vstart, void *vend)
+{
+  uint pa, end;
+  int order;
+
+  pa = V2P(PGROUNDUP((uint)vstart));
+  end = V2P(PGROUNDDOWN((uint)vend));
+  while(pa < end){
+    for(order = BUDDY_MAX_ORDER; order > 0; order--){
+      if((pa & ((PGSIZE << order) - 1)) == 0 && pa + (PGSIZE << order) <= end)
+        break;
+    }
+    block_push((struct block*)P2V(pa), order);
+    pa += PGSIZE << order;
+  }
+}
+
+void
+buddyinit2(void)
+{
+  initlock(&buddy.lock, "buddy");
+  buddy.use_lock = 1;
+}
+
+// Smallest order whose block holds size bytes, or -1 if none does.
+int
+kpage_order(uint size)
+{
+  int order;
+
+  for(order = 0; order <= BUDDY_MAX_ORDER; order++){
+    if(size <= (PGSIZE << order))
+      return order;
+  }
+  return -1;
+}
+
+// Allocate 2^order physically contiguous pages.
+// Returns 0 if no block that large is free.
+char*
+kalloc_pages(int order)
+{
+  struct block *b, *half;
+  int o;
+
+  if(order < 0 || order > BUDDY_MAX_ORDER)
+    return 0;
+  if(buddy.use_lock)
+    acquire(&buddy.lock);
+  for(o = order; o <= BUDDY_MAX_ORDER && buddy.free[o] == 0; o++)
+    ;
+  if(o > BUDDY_MAX_ORDER){
+    if(buddy.use_lock)
+      release(&buddy.lock);
+    return 0;
+  }
+  b = buddy.free[o];
+  block_remove(b, o);
+  // Split, returning the upper halves to the free lists.
+  while(o > order){
+    o--;
+    half = (struct block*)((char*)b + (PGSIZE << o));
+    block_push(half, o);
+  }
+  if(buddy.use_lock)
+    release(&buddy.lock);
+  return (char*)b;
+}
+
+// Free a block from kalloc_pages(), merging it with its buddy
+// for as long as the buddy is also free.
+void
+kfree_pages(char *v, int order)
+{
+  struct block *b;
+  uint pa, bpa;
+
+  pa = V2P(v);
+  if(order < 0 || order > BUDDY_MAX_ORDER ||
+     (pa & ((PGSIZE << order) - 1)) || pa >= PHYSTOP)
+    panic("kfree_pages");
+
+  if(buddy.use_lock)
+    acquire(&buddy.lock);
+  if(buddy.state[pa/PGSIZE])
+    panic("kfree_pages: double free");
+  while(order < BUDDY_MAX_ORDER){
+    bpa = pa ^ (PGSIZE << order);
+    if(bpa >= PHYSTOP || buddy.state[bpa/PGSIZE] != order + 1)
+      break;
+    block_remove((struct block*)P2V(bpa), order);
+    pa &= ~(PGSIZE << order);
+    order++;
+  }
+  b = (struct block*)P2V(pa);
+  block_push(b, order);
+  if(buddy.use_lock)
+    release(&buddy.lock);
+}
@@ -3,6 +3,7 @@
 
 #include "types.h"
 #include "defs.h"
+#include "mmu.h"
 #include "common.h"
 
 #define isascii(x) ((x >= 0x00) && (x <= 0x7f))
@@ -126,7 +127,7 @@ queue_push (struct queue_head *queue, void *data, size_t size) {
     if (!queue || !data) {
         return NULL;
     }
-    entry = (struct queue_entry *)kalloc();
+    entry = (struct queue_entry *)kmalloc(sizeof(*entry));
     if (!entry) {
         return NULL;
     }
@@ -160,6 +161,64 @@ queue_pop (struct queue_head *queue) {
     return entry;
 }
 
+static int
+desc_grow (struct desc_table *table) {
+    void **slot;
+    int order;
+
+    order = table->slot ? table->order + 1 : 0;
+    slot = (void **)kalloc_pages(order);
+    if (!slot) {
+        return -1;
+    }
+    memset(slot, 0, PGSIZE << order);
+    if (table->slot) {
+        memcpy(slot, table->slot, table->size * sizeof(void *));
+        kfree_pages((char *)table->slot, table->order);
+    }
+    table->slot = slot;
+    table->order = order;
+    table->size = (PGSIZE << order) / sizeof(void *);
+    return 0;
+}
+
+/* Returns the lowest free descriptor, now referring to obj, or -1. */
+int
+desc_alloc (struct desc_table *table, void *obj) {
+    int d;
+
+    for (d = table->hint; d < table->size; d++) {
+        if (!table->slot[d]) {
+            break;
+        }
+    }
+    if (d == table->size && desc_grow(table) == -1) {
+        return -1;
+    }
+    table->slot[d] = obj;
+    table->hint = d + 1;
+    return d;
+}
+
+void *
+desc_get (struct desc_table *table, int d) {
+    if (d < 0 || d >= table->size) {
+        return NULL;
+    }
+    return table->slot[d];
+}
+
+void
+desc_free (struct desc_table *table, int d) {
+    if (d < 0 || d >= table->size) {
+        return;
+    }
+    table->slot[d] = NULL;
+    if (d < table->hint) {
+        table->hint = d;
+    }
+}
+
 time_t
 time(time_t *t)
 {
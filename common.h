@@ -11,3 +11,11 @@ struct queue_head {
 };
 
 
+
+/* Maps small integer descriptors to objects; grows on demand. */
+struct desc_table {
+    void **slot;
+    int size;
+    int order; /* slot array is 2^order pages from the buddy allocator */
+    int hint;  /* no free slot below this index */
+};
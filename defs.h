@@ -2,6 +2,7 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct rtcdate;
@@ -9,6 +10,8 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct tcp_cong_ops;
+struct timer;
 
 // bio.c
 void            binit(void);
@@ -16,6 +19,13 @@ struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 
+// buddy.c
+void            buddyinit(void*, void*);
+void            buddyinit2(void);
+int             kpage_order(uint);
+char*           kalloc_pages(int);
+void            kfree_pages(char*, int);
+
 // console.c
 void            consoleinit(void);
 int             cprintf(const char*, ...);
@@ -109,6 +119,7 @@ void            exit(void);
 int             fork(void);
 int             growproc(int);
 int             kill(int);
+int             kthread_create(void (*)(void*), void*, char*);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
@@ -134,6 +145,14 @@ void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void*           kmalloc(uint);
+void            kmfree(void*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -164,6 +183,11 @@ int             fdalloc(struct file*);
 
 // timer.c
 void            timerinit(void);
+void            timerstart(void);
+void            timer_init(struct timer*, void (*)(void*), void*);
+int             timer_arm(struct timer*, uint);
+int             timer_cancel(struct timer*);
+int             timer_pending(struct timer*);
 
 // trap.c
 void            idtinit(void);
@@ -230,8 +254,10 @@ long            strtol(const char *s, char **endptr, int base);
 
 struct netdev;
 struct netif;
+struct pbuf;
 struct queue_head;
 struct queue_entry;
+struct desc_table;
 struct socket;
 struct sockaddr;
 
@@ -248,6 +274,9 @@ uint32_t        ntoh32(uint32_t n);
 uint16_t        cksum16 (uint16_t *data, uint16_t size, uint32_t init);
 struct queue_entry *queue_push(struct queue_head *queue, void *data, size_t size);
 struct queue_entry *queue_pop(struct queue_head *queue);
+int             desc_alloc(struct desc_table *table, void *obj);
+void *          desc_get(struct desc_table *table, int d);
+void            desc_free(struct desc_table *table, int d);
 time_t          time(time_t *t);
 unsigned long   random(void);
 
@@ -258,8 +287,8 @@ void            e1000intr(void);
 // ethernet.c
 int             ethernet_addr_pton(const char *p, uint8_t *n);
 char *          ethernet_addr_ntop(const uint8_t *n, char *p, size_t size);
-ssize_t         ethernet_rx_helper(struct netdev *dev, uint8_t *frame, size_t flen, void (*cb)(struct netdev*, uint16_t, uint8_t*, size_t));
-ssize_t         ethernet_tx_helper(struct netdev *dev, uint16_t type, const uint8_t *payload, size_t plen, const void *dst, ssize_t (*cb)(struct netdev*, uint8_t*, size_t));
+ssize_t         ethernet_rx_helper(struct netdev *dev, struct pbuf *pb, void (*cb)(struct netdev*, uint16_t, struct pbuf*));
+ssize_t         ethernet_tx_helper(struct netdev *dev, uint16_t type, struct pbuf *pb, const void *dst, ssize_t (*cb)(struct netdev*, struct pbuf*));
 void            ethernet_netdev_setup(struct netdev *dev);
 
 // icmp.c
@@ -274,8 +303,8 @@ struct netif *  ip_netif_register(struct netdev *dev, const char *addr, const ch
 int             ip_netif_reconfigure(struct netif *netif, ip_addr_t unicast, ip_addr_t netmask, ip_addr_t gateway);
 struct netif *  ip_netif_by_addr(ip_addr_t *addr);
 struct netif *  ip_netif_by_peer(ip_addr_t *peer);
-ssize_t         ip_tx(struct netif *netif, uint8_t protocol, const uint8_t *buf, size_t len, const ip_addr_t *dst);
-int             ip_add_protocol(uint8_t type, void (*handler)(uint8_t *payload, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *netif));
+ssize_t         ip_tx(struct netif *netif, uint8_t protocol, struct pbuf *pb, const ip_addr_t *dst);
+int             ip_add_protocol(uint8_t type, void (*handler)(struct pbuf *pb, ip_addr_t *src, ip_addr_t *dst, struct netif *netif));
 int             ip_init(void);
 
 // mt19937ar.c
@@ -288,11 +317,29 @@ struct netdev * netdev_alloc(void (*setup)(struct netdev *));
 int             netdev_register(struct netdev *dev);
 struct netdev * netdev_by_index(int index);
 struct netdev * netdev_by_name(const char *name);
-void            netdev_receive(struct netdev *dev, uint16_t type, uint8_t *packet, unsigned int plen);
+void            netdev_receive(struct netdev *dev, uint16_t type, struct pbuf *pb);
 int             netdev_add_netif(struct netdev *dev, struct netif *netif);
 struct netif *  netdev_get_netif(struct netdev *dev, int family);
-int             netproto_register(unsigned short type, void (*handler)(uint8_t *packet, size_t plen, struct netdev *dev));
+int             netproto_register(unsigned short type, void (*handler)(struct pbuf *pb, struct netdev *dev));
+void            netdev_poll_schedule(struct netdev *dev);
+void            netdev_poll_complete(struct netdev *dev);
 void            netinit(void);
+void            netstart(void);
+
+// pbuf.c
+struct pbuf *   pbuf_alloc(void);
+struct pbuf *   pbuf_ref(struct pbuf *pb);
+void            pbuf_free(struct pbuf *pb);
+uint8_t *       pbuf_pull(struct pbuf *pb, size_t len);
+uint8_t *       pbuf_push(struct pbuf *pb, size_t len);
+uint8_t *       pbuf_put(struct pbuf *pb, size_t len);
+int             pbuf_append(struct pbuf *pb, const void *data, size_t len);
+struct pbuf *   pbuf_prepend(struct pbuf *pb, size_t len);
+size_t          pbuf_length(struct pbuf *pb);
+size_t          pbuf_copydata(struct pbuf *pb, size_t off, size_t len, void *dst);
+uint16_t        pbuf_cksum16(struct pbuf *pb, uint32_t init);
+void            pbuf_trim(struct pbuf *pb, size_t len);
+void            pbuf_init(void);
 
 // tcp.c
 int             tcp_init(void);
@@ -304,6 +351,11 @@ int             tcp_api_listen(int soc, int backlog);
 int             tcp_api_accept(int soc, struct sockaddr *addr, int *addrlen);
 ssize_t         tcp_api_recv(int soc, uint8_t *buf, size_t size);
 ssize_t         tcp_api_send(int soc, uint8_t *buf, size_t len);
+int             tcp_api_setsockopt(int soc, int level, int name, void *val, int len);
+
+// tcp_cong.c
+struct tcp_cong_ops *tcp_cong_default(void);
+struct tcp_cong_ops *tcp_cong_find(const char *name);
 
 // udp.c
 int             udp_init(void);
@@ -325,6 +377,7 @@ int             socketwrite(struct socket*, char*, int);
 int             socketrecvfrom(struct socket*, char*, int, struct sockaddr*, int*);
 int             socketsendto(struct socket*, char*, int, struct sockaddr*, int);
 int             socketioctl(struct socket*, int, void*);
+int             socketsetsockopt(struct socket*, int, int, void*, int);
 
 #define sizeof_member(s, m) sizeof(((s *)NULL)->m)
 #define array_tailof(x) (x + (sizeof(x) / sizeof(*x)))
@@ -8,16 +8,42 @@
 #include "mmu.h"
 #include "pci.h"
 #include "proc.h"
+#include "spinlock.h"
 #include "net.h"
+#include "pbuf.h"
+#include "socket.h"
 #include "e1000_dev.h"
 
-#define RX_RING_SIZE 16
-#define TX_RING_SIZE 16
+#define RX_RING_SIZE_DEFAULT 256
+#define TX_RING_SIZE_DEFAULT 256
+#define RING_SIZE_MIN 8      /* RDLEN/TDLEN must be 128-byte aligned */
+#define RING_SIZE_MAX 4096   /* hardware limit */
+
+// Interrupt moderation defaults (microseconds)
+#define RX_USECS_DEFAULT     0
+#define RX_ABS_USECS_DEFAULT 8
+#define TX_USECS_DEFAULT     8
+#define TX_ABS_USECS_DEFAULT 32
+#define ITR_USECS_DEFAULT    125  /* at most 8000 interrupts/sec */
 
 struct e1000 {
     uint32_t mmio_base;
-    struct rx_desc rx_ring[RX_RING_SIZE] __attribute__((aligned(16)));;
-    struct tx_desc tx_ring[TX_RING_SIZE] __attribute__((aligned(16)));;
+    struct rx_desc *rx_ring;
+    struct tx_desc *tx_ring;
+    struct pbuf **tx_pbufs; /* packet to release when a slot completes */
+    uint32_t rx_ring_size;
+    uint32_t tx_ring_size;
+    uint32_t tx_head; /* oldest descriptor not yet reclaimed */
+    uint32_t tx_tail; /* next descriptor to be filled */
+    struct spinlock txlock;
+    /* interrupt moderation, in register units */
+    uint16_t rdtr;
+    uint16_t radv;
+    uint16_t tidv;
+    uint16_t tadv;
+    uint16_t itr;
+    uint32_t rdmts; /* RCTL_RDMTS_* threshold */
+    uint8_t rxdmt;  /* interrupt at the threshold (rx-frames set) */
     uint8_t addr[6];
     uint8_t irq;
     struct netdev *netdev;
@@ -73,51 +99,147 @@ e1000_resolve_mmio_base(struct pci_func *pcif)
     return mmio_base;
 }
 
+// Descriptor rings must be physically contiguous,
+// so they come from the buddy allocator.
+static void *
+e1000_ring_alloc(size_t size)
+{
+    void *ring;
+    int order;
+
+    order = kpage_order(size);
+    if (order == -1) {
+        return NULL;
+    }
+    ring = kalloc_pages(order);
+    if (ring) {
+        memset(ring, 0, PGSIZE << order);
+    }
+    return ring;
+}
+
+static void
+e1000_ring_free(void *ring, size_t size)
+{
+    kfree_pages((char *)ring, kpage_order(size));
+}
+
+static uint32_t
+e1000_ring_size(uint32_t size, uint32_t def)
+{
+    if (!size) {
+        size = def;
+    }
+    size = ROUNDUP(size, RING_SIZE_MIN);
+    return MIN(size, (uint32_t)RING_SIZE_MAX);
+}
+
+// Each RX slot holds a pbuf; the descriptor points at its buffer.
+static struct pbuf *
+e1000_rx_pbuf(struct rx_desc *desc)
+{
+    return (struct pbuf *)PGROUNDDOWN((uint32_t)P2V((uint32_t)desc->addr));
+}
+
 static void
+e1000_rx_free(struct e1000 *dev, int nbuf)
+{
+    for (int n = 0; n < nbuf; n++) {
+        pbuf_free(e1000_rx_pbuf(&dev->rx_ring[n]));
+    }
+    e1000_ring_free(dev->rx_ring, dev->rx_ring_size * sizeof(struct rx_desc));
+    dev->rx_ring = NULL;
+}
+
+static void
+e1000_tx_free(struct e1000 *dev)
+{
+    if (dev->tx_pbufs) {
+        e1000_ring_free(dev->tx_pbufs, dev->tx_ring_size * sizeof(struct pbuf *));
+        dev->tx_pbufs = NULL;
+    }
+    e1000_ring_free(dev->tx_ring, dev->tx_ring_size * sizeof(struct tx_desc));
+    dev->tx_ring = NULL;
+}
+
+static int
 e1000_rx_init(struct e1000 *dev)
 {
+    if (!dev->rx_ring) {
+        dev->rx_ring = e1000_ring_alloc(dev->rx_ring_size * sizeof(struct rx_desc));
+        if (!dev->rx_ring) {
+            return -1;
+        }
+        for (int n = 0; n < dev->rx_ring_size; n++) {
+            // alloc DMA buffer
+            struct pbuf *pb = pbuf_alloc();
+            if (!pb) {
+                e1000_rx_free(dev, n);
+                return -1;
+            }
+            dev->rx_ring[n].addr = (uint64_t)V2P(pb->buf);
+        }
+    }
     // initialize rx descriptors
-    for(int n = 0; n < RX_RING_SIZE; n++) {
-        memset(&dev->rx_ring[n], 0, sizeof(struct rx_desc));
-        // alloc DMA buffer
-        dev->rx_ring[n].addr = (uint64_t)V2P(kalloc());
+    for (int n = 0; n < dev->rx_ring_size; n++) {
+        dev->rx_ring[n].status = 0;
     }
     // setup rx descriptors
     uint64_t base = (uint64_t)(V2P(dev->rx_ring));
     e1000_reg_write(dev, E1000_RDBAL, (uint32_t)(base & 0xffffffff));
     e1000_reg_write(dev, E1000_RDBAH, (uint32_t)(base >> 32));
     // rx descriptor lengh
-    e1000_reg_write(dev, E1000_RDLEN, (uint32_t)(RX_RING_SIZE * sizeof(struct rx_desc)));
+    e1000_reg_write(dev, E1000_RDLEN, (uint32_t)(dev->rx_ring_size * sizeof(struct rx_desc)));
     // setup head/tail
     e1000_reg_write(dev, E1000_RDH, 0);
-    e1000_reg_write(dev, E1000_RDT, RX_RING_SIZE-1);
+    e1000_reg_write(dev, E1000_RDT, dev->rx_ring_size-1);
     // set tx control register
     e1000_reg_write(dev, E1000_RCTL, (
         E1000_RCTL_SBP        | /* store bad packet */
         E1000_RCTL_UPE        | /* unicast promiscuous enable */
         E1000_RCTL_MPE        | /* multicast promiscuous enab */
-        E1000_RCTL_RDMTS_HALF | /* rx desc min threshold size */
+        (dev->rdmts & E1000_RCTL_RDMTS_MASK) | /* rx desc min threshold size */
         E1000_RCTL_SECRC      | /* Strip Ethernet CRC */
         E1000_RCTL_LPE        | /* long packet enable */
         E1000_RCTL_BAM        | /* broadcast enable */
         E1000_RCTL_SZ_2048    | /* rx buffer size 2048 */
         0)
     );
+    return 0;
 }
 
-static void
+static int
 e1000_tx_init(struct e1000 *dev)
 {
-    // initialize tx descriptors
-    for (int n = 0; n < TX_RING_SIZE; n++) {
-        memset(&dev->tx_ring[n], 0, sizeof(struct tx_desc));
+    if (!dev->tx_ring) {
+        dev->tx_ring = e1000_ring_alloc(dev->tx_ring_size * sizeof(struct tx_desc));
+        if (!dev->tx_ring) {
+            return -1;
+        }
+        // frames are sent straight from their pbufs; no DMA buffers of our own
+        dev->tx_pbufs = (struct pbuf **)e1000_ring_alloc(dev->tx_ring_size * sizeof(struct pbuf *));
+        if (!dev->tx_pbufs) {
+            e1000_tx_free(dev);
+            return -1;
+        }
     }
+    // initialize tx descriptors, dropping frames left over from a previous open
+    for (int n = 0; n < dev->tx_ring_size; n++) {
+        if (dev->tx_pbufs[n]) {
+            pbuf_free(dev->tx_pbufs[n]);
+            dev->tx_pbufs[n] = NULL;
+        }
+        dev->tx_ring[n].addr = 0;
+        dev->tx_ring[n].cmd = 0;
+        dev->tx_ring[n].status = 0;
+    }
+    dev->tx_head = dev->tx_tail = 0;
     // setup tx descriptors
     uint64_t base = (uint64_t)(V2P(dev->tx_ring));
     e1000_reg_write(dev, E1000_TDBAL, (uint32_t)(base & 0xffffffff));
     e1000_reg_write(dev, E1000_TDBAH, (uint32_t)(base >> 32) );
     // tx descriptor length
-    e1000_reg_write(dev, E1000_TDLEN, (uint32_t)(TX_RING_SIZE * sizeof(struct tx_desc)));
+    e1000_reg_write(dev, E1000_TDLEN, (uint32_t)(dev->tx_ring_size * sizeof(struct tx_desc)));
     // setup head/tail
     e1000_reg_write(dev, E1000_TDH, 0);
     e1000_reg_write(dev, E1000_TDT, 0);
@@ -126,14 +248,173 @@ e1000_tx_init(struct e1000 *dev)
         E1000_TCTL_PSP | /* pad short packets */
         0)
     );
+    return 0;
+}
+
+static uint16_t
+e1000_usecs_to_reg(uint32_t usecs, uint32_t unit_ns)
+{
+    uint32_t val = (usecs * 1000 + unit_ns - 1) / unit_ns;
+    return val > E1000_DELAY_MAX ? E1000_DELAY_MAX : val;
+}
+
+static uint16_t
+e1000_reg_to_usecs(uint16_t val, uint32_t unit_ns)
+{
+    return ((uint32_t)val * unit_ns) / 1000;
+}
+
+// Pending frames at which RXDMT0 fires for a given threshold:
+// the interrupt is raised once free descriptors drop to 1/2, 1/4 or 1/8 of the ring.
+static uint32_t
+e1000_rdmts_frames(struct e1000 *dev, uint32_t rdmts)
+{
+    switch (rdmts) {
+    case E1000_RCTL_RDMTS_HALF:
+        return dev->rx_ring_size / 2;
+    case E1000_RCTL_RDMTS_QUAT:
+        return dev->rx_ring_size - dev->rx_ring_size / 4;
+    case E1000_RCTL_RDMTS_EIGTH:
+        return dev->rx_ring_size - dev->rx_ring_size / 8;
+    }
+    return 0;
+}
+
+static uint32_t
+e1000_rx_interrupt_mask(struct e1000 *dev)
+{
+    uint32_t mask = E1000_IMS_RXT0;
+    if (dev->rxdmt)
+        mask |= E1000_IMS_RXDMT0;
+    return mask;
+}
+
+static uint32_t
+e1000_interrupt_mask(struct e1000 *dev)
+{
+    return e1000_rx_interrupt_mask(dev) | E1000_IMS_TXDW;
+}
+
+static void
+e1000_coalesce_apply(struct e1000 *dev)
+{
+    e1000_reg_write(dev, E1000_RDTR, dev->rdtr);
+    e1000_reg_write(dev, E1000_RADV, dev->radv);
+    e1000_reg_write(dev, E1000_TIDV, dev->tidv);
+    e1000_reg_write(dev, E1000_TADV, dev->tadv);
+    e1000_reg_write(dev, E1000_ITR, dev->itr);
+}
+
+static int
+e1000_get_coalesce(struct netdev *netdev, struct ifcoalesce *ic)
+{
+    struct e1000 *dev = (struct e1000 *)netdev->priv;
+    ic->rx_frames = dev->rxdmt ? e1000_rdmts_frames(dev, dev->rdmts) : 0;
+    ic->rx_usecs = e1000_reg_to_usecs(dev->rdtr, E1000_DELAY_UNIT_NS);
+    ic->rx_abs_usecs = e1000_reg_to_usecs(dev->radv, E1000_DELAY_UNIT_NS);
+    ic->tx_usecs = e1000_reg_to_usecs(dev->tidv, E1000_DELAY_UNIT_NS);
+    ic->tx_abs_usecs = e1000_reg_to_usecs(dev->tadv, E1000_DELAY_UNIT_NS);
+    ic->itr_usecs = e1000_reg_to_usecs(dev->itr, E1000_ITR_UNIT_NS);
+    return 0;
+}
+
+static int
+e1000_set_coalesce(struct netdev *netdev, const struct ifcoalesce *ic)
+{
+    struct e1000 *dev = (struct e1000 *)netdev->priv;
+    uint32_t old_mask;
+
+    if (ic->rx_frames >= dev->rx_ring_size) {
+        return -1;
+    }
+    old_mask = e1000_interrupt_mask(dev);
+    // The 8254x has no frame counter; use the nearest descriptor threshold
+    // with rx-frames off the threshold stays at its reset value, unused
+    dev->rxdmt = ic->rx_frames != 0;
+    if (!ic->rx_frames)
+        dev->rdmts = E1000_RCTL_RDMTS_HALF;
+    else if (ic->rx_frames <= e1000_rdmts_frames(dev, E1000_RCTL_RDMTS_HALF))
+        dev->rdmts = E1000_RCTL_RDMTS_HALF;
+    else if (ic->rx_frames <= e1000_rdmts_frames(dev, E1000_RCTL_RDMTS_QUAT))
+        dev->rdmts = E1000_RCTL_RDMTS_QUAT;
+    else
+        dev->rdmts = E1000_RCTL_RDMTS_EIGTH;
+    dev->rdtr = e1000_usecs_to_reg(ic->rx_usecs, E1000_DELAY_UNIT_NS);
+    dev->radv = e1000_usecs_to_reg(ic->rx_abs_usecs, E1000_DELAY_UNIT_NS);
+    dev->tidv = e1000_usecs_to_reg(ic->tx_usecs, E1000_DELAY_UNIT_NS);
+    dev->tadv = e1000_usecs_to_reg(ic->tx_abs_usecs, E1000_DELAY_UNIT_NS);
+    dev->itr = e1000_usecs_to_reg(ic->itr_usecs, E1000_ITR_UNIT_NS);
+    e1000_coalesce_apply(dev);
+    e1000_reg_write(dev, E1000_RCTL, (e1000_reg_read(dev, E1000_RCTL) & ~E1000_RCTL_RDMTS_MASK) | (dev->rdmts & E1000_RCTL_RDMTS_MASK));
+    if (netdev->flags & NETDEV_FLAG_UP) {
+        e1000_reg_write(dev, E1000_IMC, old_mask);
+        // RX interrupts stay masked while the poller owns the ring
+        e1000_reg_write(dev, E1000_IMS, netdev->poll_scheduled ? E1000_IMS_TXDW : e1000_interrupt_mask(dev));
+    }
+    return 0;
+}
+
+static int
+e1000_get_ringparam(struct netdev *netdev, struct ifringparam *rp)
+{
+    struct e1000 *dev = (struct e1000 *)netdev->priv;
+    rp->rx_max = RING_SIZE_MAX;
+    rp->tx_max = RING_SIZE_MAX;
+    rp->rx_pending = dev->rx_ring_size;
+    rp->tx_pending = dev->tx_ring_size;
+    return 0;
+}
+
+// Resize the rings of a device that is down. Rings left from an earlier
+// open are freed here and allocated at the new size on the next open.
+static int
+e1000_set_ringparam(struct netdev *netdev, const struct ifringparam *rp)
+{
+    struct e1000 *dev = (struct e1000 *)netdev->priv;
+    uint32_t rx, tx;
+
+    if ((netdev->flags & NETDEV_FLAG_UP) || netdev->poll_scheduled) {
+        return -1;
+    }
+    if (rp->rx_pending > RING_SIZE_MAX || rp->tx_pending > RING_SIZE_MAX) {
+        return -1;
+    }
+    rx = e1000_ring_size(rp->rx_pending, dev->rx_ring_size);
+    tx = e1000_ring_size(rp->tx_pending, dev->tx_ring_size);
+    if (dev->rx_ring && rx != dev->rx_ring_size) {
+        e1000_rx_free(dev, dev->rx_ring_size);
+    }
+    acquire(&dev->txlock);
+    if (dev->tx_ring && tx != dev->tx_ring_size) {
+        for (int n = 0; n < dev->tx_ring_size; n++) {
+            if (dev->tx_pbufs[n]) {
+                pbuf_free(dev->tx_pbufs[n]);
+            }
+        }
+        e1000_tx_free(dev);
+    }
+    dev->rx_ring_size = rx;
+    dev->tx_ring_size = tx;
+    release(&dev->txlock);
+    return 0;
 }
 
 static int
 e1000_open(struct netdev *netdev)
 {
     struct e1000 *dev = (struct e1000 *)netdev->priv;
+    if (netdev->flags & NETDEV_FLAG_UP) {
+        return 0;
+    }
+    // Initialize RX/TX (rings are allocated on first open)
+    if (e1000_rx_init(dev) == -1 || e1000_tx_init(dev) == -1) {
+        cprintf("[e1000] %s: failed to allocate rings\n", netdev->name);
+        return -1;
+    }
+    // interrupt moderation
+    e1000_coalesce_apply(dev);
     // enable interrupts
-    e1000_reg_write(dev, E1000_IMS, E1000_IMS_RXT0);
+    e1000_reg_write(dev, E1000_IMS, e1000_interrupt_mask(dev));
     // clear existing pending interrupts
     e1000_reg_read(dev, E1000_ICR);
     // enable RX/TX
@@ -150,7 +431,7 @@ e1000_stop(struct netdev *netdev)
 {
     struct e1000 *dev = (struct e1000 *)netdev->priv;
     // disable interrupts
-    e1000_reg_write(dev, E1000_IMC, E1000_IMS_RXT0);
+    e1000_reg_write(dev, E1000_IMC, e1000_interrupt_mask(dev));
     // clear existing pending interrupts
     e1000_reg_read(dev, E1000_ICR);
     // disable RX/TX
@@ -162,41 +443,116 @@ e1000_stop(struct netdev *netdev)
     return 0;
 }
 
+// Reclaim descriptors the hardware has finished with.
+// Caller must hold dev->txlock.
+static void
+e1000_tx_reclaim(struct e1000 *dev)
+{
+    struct tx_desc *desc;
+
+    while (dev->tx_head != dev->tx_tail) {
+        desc = &dev->tx_ring[dev->tx_head];
+        if (!(desc->status & E1000_TXD_STAT_DD)) {
+            break;
+        }
+        desc->status = 0;
+        if (dev->tx_pbufs[dev->tx_head]) {
+            pbuf_free(dev->tx_pbufs[dev->tx_head]);
+            dev->tx_pbufs[dev->tx_head] = NULL;
+        }
+        dev->tx_head = (dev->tx_head + 1) % dev->tx_ring_size;
+    }
+}
+
+static uint32_t
+e1000_tx_free_slots(struct e1000 *dev)
+{
+    return dev->tx_ring_size - 1 - (dev->tx_tail + dev->tx_ring_size - dev->tx_head) % dev->tx_ring_size;
+}
+
+// Queue a frame with one descriptor per fragment; the device gathers
+// them. The pbuf is released once its last descriptor completes.
 static ssize_t
-e1000_tx_cb(struct netdev *netdev, uint8_t *data, size_t len)
+e1000_tx_cb(struct netdev *netdev, struct pbuf *pb)
 {
     struct e1000 *dev = (struct e1000 *)netdev->priv;
-    uint32_t tail = e1000_reg_read(dev, E1000_TDT);
-    struct tx_desc *desc = &dev->tx_ring[tail];
+    struct tx_desc *desc;
+    struct pbuf *frag, *last = NULL;
+    uint32_t nfrag = 0;
+    size_t len = 0;
 
-    desc->addr = (uint64_t)V2P(data);
-    desc->length = len;
-    desc->status = 0;
-    desc->cmd = (E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS);
+    for (frag = pb; frag; frag = frag->frag) {
+        if (frag->len) {
+            last = frag;
+            nfrag++;
+            len += frag->len;
+        }
+    }
+    if (!nfrag || nfrag >= dev->tx_ring_size) {
+        pbuf_free(pb);
+        return -1;
+    }
+    acquire(&dev->txlock);
+    if (!dev->tx_ring) {
+        // not opened yet, or resized while down
+        release(&dev->txlock);
+        pbuf_free(pb);
+        return -1;
+    }
+    e1000_tx_reclaim(dev);
+    // ring full: drop rather than wait; TCP retransmits, UDP may lose it
+    if (e1000_tx_free_slots(dev) < nfrag) {
+        release(&dev->txlock);
+        pbuf_free(pb);
+        return -1;
+    }
+    for (frag = pb; frag; frag = frag->frag) {
+        if (!frag->len) {
+            continue;
+        }
+        desc = &dev->tx_ring[dev->tx_tail];
+        desc->addr = (uint64_t)V2P(frag->data);
+        desc->length = frag->len;
+        desc->status = 0;
+        desc->cmd = E1000_TXD_CMD_RS;
+        if (frag == last)
+            desc->cmd |= E1000_TXD_CMD_EOP;
+        if (dev->tidv)
+            desc->cmd |= E1000_TXD_CMD_IDE;
+        dev->tx_pbufs[dev->tx_tail] = (frag == last) ? pb : NULL;
+        dev->tx_tail = (dev->tx_tail + 1) % dev->tx_ring_size;
+    }
 #ifdef DEBUG
-    cprintf("[e1000] %s: %u bytes data transmit\n", dev->netdev->name, desc->length);
+    cprintf("[e1000] %s: %u bytes data transmit (%u fragments)\n", dev->netdev->name, len, nfrag);
 #endif
-    e1000_reg_write(dev, E1000_TDT, (tail + 1) % TX_RING_SIZE);
-    while(!(desc->status & 0x0f)) {
-        microdelay(1);
-    }
+    e1000_reg_write(dev, E1000_TDT, dev->tx_tail);
+    release(&dev->txlock);
     return len;
 }
 
 static ssize_t
-e1000_tx(struct netdev *dev, uint16_t type, const uint8_t *packet, size_t len, const void *dst)
+e1000_tx(struct netdev *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
-    return ethernet_tx_helper(dev, type, packet, len, dst, e1000_tx_cb);
+    return ethernet_tx_helper(dev, type, pb, dst, e1000_tx_cb);
 }
 
-static void
-e1000_rx(struct e1000 *dev)
+static int
+e1000_rx_pending(struct e1000 *dev)
 {
+    uint32_t tail = (e1000_reg_read(dev, E1000_RDT)+1) % dev->rx_ring_size;
+    return dev->rx_ring[tail].status & E1000_RXD_STAT_DD;
+}
+
+// Process at most budget received frames, returning how many were consumed.
+static int
+e1000_rx(struct e1000 *dev, int budget)
+{
+    int done = 0;
 #ifdef DEBUG
     cprintf("[e1000] %s: check rx descriptors...\n", dev->netdev->name);
 #endif
-    while (1) {
-        uint32_t tail = (e1000_reg_read(dev, E1000_RDT)+1) % RX_RING_SIZE;
+    while (done < budget) {
+        uint32_t tail = (e1000_reg_read(dev, E1000_RDT)+1) % dev->rx_ring_size;
         struct rx_desc *desc = &dev->rx_ring[tail];
         if (!(desc->status & E1000_RXD_STAT_DD)) {
             /* EMPTY */
@@ -218,11 +574,45 @@ e1000_rx(struct e1000 *dev)
 #ifdef DEBUG
             cprintf("[e1000] %s: %u bytes data received\n", dev->netdev->name, desc->length);
 #endif
-            ethernet_rx_helper(dev->netdev, P2V((uint32_t)desc->addr), desc->length, netdev_receive);
+            // hand the filled buffer up the stack and refill the slot;
+            // without a spare buffer the frame is dropped and the old one reused
+            struct pbuf *fresh = pbuf_alloc();
+            if (!fresh) {
+                cprintf("[e1000] %s: no rx buffer, drop\n", dev->netdev->name);
+                break;
+            }
+            struct pbuf *pb = e1000_rx_pbuf(desc);
+            pb->data = pb->buf;
+            pb->len = desc->length;
+            desc->addr = (uint64_t)V2P(fresh->buf);
+            ethernet_rx_helper(dev->netdev, pb, netdev_receive);
         } while (0);
         desc->status = (uint16_t)(0);
         e1000_reg_write(dev, E1000_RDT, tail);
+        done++;
     }
+    return done;
+}
+
+// Runs in the poller thread with RX interrupts masked.
+static int
+e1000_poll(struct netdev *netdev, int budget)
+{
+    struct e1000 *dev = (struct e1000 *)netdev->priv;
+    int done;
+
+    done = e1000_rx(dev, budget);
+    if (done < budget) {
+        netdev_poll_complete(netdev);
+        e1000_reg_write(dev, E1000_IMS, e1000_rx_interrupt_mask(dev));
+        // a frame that landed after the ring was drained may not raise
+        // an interrupt of its own, so pick it up here
+        if (e1000_rx_pending(dev)) {
+            e1000_reg_write(dev, E1000_IMC, e1000_rx_interrupt_mask(dev));
+            netdev_poll_schedule(netdev);
+        }
+    }
+    return done;
 }
 
 void
@@ -235,10 +625,15 @@ e1000intr(void)
 #endif
     for (dev = devices; dev; dev = dev->next) {
         icr = e1000_reg_read(dev, E1000_ICR);
-        if (icr & E1000_ICR_RXT0) {
-            e1000_rx(dev);
-            // clear pending interrupts
-            e1000_reg_read(dev, E1000_ICR);
+        if (icr & E1000_ICR_TXDW) {
+            acquire(&dev->txlock);
+            e1000_tx_reclaim(dev);
+            release(&dev->txlock);
+        }
+        if (icr & (E1000_ICR_RXT0 | E1000_ICR_RXDMT0)) {
+            // leave the ring to the poller until it is drained
+            e1000_reg_write(dev, E1000_IMC, e1000_rx_interrupt_mask(dev));
+            netdev_poll_schedule(dev->netdev);
         }
     }
 #ifdef DEBUG
@@ -256,13 +651,19 @@ struct netdev_ops e1000_ops = {
     .open = e1000_open,
     .stop = e1000_stop,
     .xmit = e1000_tx,
+    .poll = e1000_poll,
+    .get_coalesce = e1000_get_coalesce,
+    .set_coalesce = e1000_set_coalesce,
+    .get_ringparam = e1000_get_ringparam,
+    .set_ringparam = e1000_set_ringparam,
 };
 
 int
 e1000_init(struct pci_func *pcif)
 {
     pci_func_enable(pcif);
-    struct e1000 *dev = (struct e1000 *)kalloc();
+    struct e1000 *dev = (struct e1000 *)kmalloc(sizeof(*dev));
+    memset(dev, 0, sizeof(*dev));
     // Resolve MMIO base address
     dev->mmio_base = e1000_resolve_mmio_base(pcif);
     assert(dev->mmio_base);
@@ -276,9 +677,19 @@ e1000_init(struct pci_func *pcif)
     // Initialize Multicast Table Array
     for (int n = 0; n < 128; n++)
         e1000_reg_write(dev, E1000_MTA + (n << 2), 0);
-    // Initialize RX/TX
-    e1000_rx_init(dev);
-    e1000_tx_init(dev);
+    // Rings are allocated on open; SIOCSIFRINGPARAM resizes them while down
+    dev->rx_ring_size = e1000_ring_size(0, RX_RING_SIZE_DEFAULT);
+    dev->tx_ring_size = e1000_ring_size(0, TX_RING_SIZE_DEFAULT);
+    cprintf("[e1000] rx_ring=%u tx_ring=%u\n", dev->rx_ring_size, dev->tx_ring_size);
+    initlock(&dev->txlock, "e1000tx");
+    // Interrupt moderation is programmed on open
+    dev->rdtr = e1000_usecs_to_reg(RX_USECS_DEFAULT, E1000_DELAY_UNIT_NS);
+    dev->radv = e1000_usecs_to_reg(RX_ABS_USECS_DEFAULT, E1000_DELAY_UNIT_NS);
+    dev->tidv = e1000_usecs_to_reg(TX_USECS_DEFAULT, E1000_DELAY_UNIT_NS);
+    dev->tadv = e1000_usecs_to_reg(TX_ABS_USECS_DEFAULT, E1000_DELAY_UNIT_NS);
+    dev->itr = e1000_usecs_to_reg(ITR_USECS_DEFAULT, E1000_ITR_UNIT_NS);
+    dev->rdmts = E1000_RCTL_RDMTS_HALF;
+    dev->rxdmt = 0;
     // Alloc netdev
     struct netdev *netdev = netdev_alloc(e1000_setup);
     memcpy(netdev->addr, dev->addr, 6);
@@ -7,6 +7,7 @@
 #define E1000_CTL      (0x0000)  /* Device Control Register - RW */
 #define E1000_EERD     (0x0014)  /* EEPROM Read - RW */
 #define E1000_ICR      (0x00C0)  /* Interrupt Cause Read - R */
+#define E1000_ITR      (0x00C4)  /* Interrupt Throttling Rate - RW */
 #define E1000_IMS      (0x00D0)  /* Interrupt Mask Set - RW */
 #define E1000_IMC      (0x00D8)  /* Interrupt Mask Clear - RW */
 #define E1000_RCTL     (0x0100)  /* RX Control - RW */
@@ -25,6 +26,8 @@
 #define E1000_TDLEN    (0x3808)  /* TX Descriptor Length - RW */
 #define E1000_TDH      (0x3810)  /* TX Descriptor Head - RW */
 #define E1000_TDT      (0x3818)  /* TX Descripotr Tail - RW */
+#define E1000_TIDV     (0x3820)  /* TX Interrupt Delay Value - RW */
+#define E1000_TADV     (0x382C)  /* TX Interrupt Absolute Delay Val - RW */
 #define E1000_MTA      (0x5200)  /* Multicast Table Array - RW Array */
 #define E1000_RA       (0x5400)  /* Receive Address - RW Array */
 
@@ -41,9 +44,18 @@
 #define E1000_EERD_DONE (1 << 4) /* 4th bit */
 
 /* Interrupt */
+#define E1000_IMS_TXDW    0x00000001     /* tx desc written back */
+#define E1000_IMS_RXDMT0  0x00000010     /* rx desc min. threshold */
 #define E1000_IMS_RXT0    0x00000080     /* rx timer intr */
+#define E1000_ICR_TXDW    E1000_IMS_TXDW
+#define E1000_ICR_RXDMT0  E1000_IMS_RXDMT0
 #define E1000_ICR_RXT0    E1000_IMS_RXT0
 
+/* Interrupt Delay Timers: RDTR/RADV/TIDV/TADV count 1.024us units, ITR 256ns units */
+#define E1000_DELAY_UNIT_NS 1024
+#define E1000_ITR_UNIT_NS   256
+#define E1000_DELAY_MAX     0xffff
+
 /* Transmit Control */
 #define E1000_TCTL_RST    0x00000001    /* software reset */
 #define E1000_TCTL_EN     0x00000002    /* enable tx */
@@ -75,6 +87,7 @@
 #define E1000_RCTL_RDMTS_HALF     0x00000000    /* rx desc min threshold size */
 #define E1000_RCTL_RDMTS_QUAT     0x00000100    /* rx desc min threshold size */
 #define E1000_RCTL_RDMTS_EIGTH    0x00000200    /* rx desc min threshold size */
+#define E1000_RCTL_RDMTS_MASK     0x00000300    /* rx desc min threshold size */
 #define E1000_RCTL_MO_SHIFT       12            /* multicast offset shift */
 #define E1000_RCTL_MO_0           0x00000000    /* multicast offset 11:0 */
 #define E1000_RCTL_MO_1           0x00001000    /* multicast offset 12:1 */
@@ -107,6 +120,7 @@
 #define E1000_TXD_CMD_EOP    0x01 /* End of Packet */
 #define E1000_TXD_CMD_IFCS   0x02 /* Insert FCS (Ethernet CRC) */
 #define E1000_TXD_CMD_RS     0x08 /* Report Status */
+#define E1000_TXD_CMD_IDE    0x80 /* Enable Tidv register */
 #define E1000_TXD_CMD_DEXT   0x20 /* Descriptor extension (0 = legacy) */
 
 /* Transmit Descriptor status definitions [E1000 3.3.3.2] */
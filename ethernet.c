@@ -4,6 +4,7 @@
 #include "types.h"
 #include "defs.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ethernet.h"
 
 const uint8_t ETHERNET_ADDR_ANY[ETHERNET_ADDR_LEN] = {"\x00\x00\x00\x00\x00\x00"};
@@ -72,54 +73,61 @@ ethernet_dump(struct netdev *dev, uint8_t *frame, size_t flen)
     hexdump(frame, flen);
 }
 
+// Consumes pb: it is either handed to cb or freed.
 ssize_t
-ethernet_rx_helper(struct netdev *dev, uint8_t *frame, size_t flen, void (*cb)(struct netdev*, uint16_t, uint8_t*, size_t))
+ethernet_rx_helper(struct netdev *dev, struct pbuf *pb, void (*cb)(struct netdev*, uint16_t, struct pbuf*))
 {
     struct ethernet_hdr *hdr;
-    uint8_t *payload;
-    size_t plen;
 
-    if (flen < sizeof(struct ethernet_hdr)) {
+    if (pb->len < sizeof(struct ethernet_hdr)) {
+        pbuf_free(pb);
         return -1;
     }
-    hdr = (struct ethernet_hdr *)frame;
+    hdr = (struct ethernet_hdr *)pb->data;
     if (memcmp(dev->addr, hdr->dst, ETHERNET_ADDR_LEN) != 0) {
         if (memcmp(ETHERNET_ADDR_BROADCAST, hdr->dst, ETHERNET_ADDR_LEN) != 0) {
+            pbuf_free(pb);
             return -1;
         }
     }
 #ifdef DEBUG
     cprintf(">>> ethernet_rx <<<\n");
-    ethernet_dump(dev, frame, flen);
+    ethernet_dump(dev, pb->data, pb->len);
 #endif
-    payload = (uint8_t *)(hdr + 1);
-    plen = flen - sizeof(struct ethernet_hdr);
-    cb(dev, hdr->type, payload, plen);
+    pbuf_pull(pb, sizeof(struct ethernet_hdr));
+    cb(dev, hdr->type, pb);
     return 0;
 }
 
+// Consumes pb. The header goes into its headroom; short frames
+// are padded by the device.
 ssize_t
-ethernet_tx_helper(struct netdev *dev, uint16_t type, const uint8_t *payload, size_t plen, const void *dst, ssize_t (*cb)(struct netdev*, uint8_t*, size_t))
+ethernet_tx_helper(struct netdev *dev, uint16_t type, struct pbuf *pb, const void *dst, ssize_t (*cb)(struct netdev*, struct pbuf*))
 {
-    uint8_t frame[ETHERNET_FRAME_SIZE_MAX];
+    struct pbuf *frame;
     struct ethernet_hdr *hdr;
-    size_t flen;
+    size_t plen, flen;
 
-    if (!payload || plen > ETHERNET_PAYLOAD_SIZE_MAX || !dst) {
+    plen = pbuf_length(pb);
+    if (plen > ETHERNET_PAYLOAD_SIZE_MAX || !dst) {
+        pbuf_free(pb);
         return -1;
     }
-    memset(frame, 0, sizeof(frame));
-    hdr = (struct ethernet_hdr *)frame;
+    frame = pbuf_prepend(pb, sizeof(struct ethernet_hdr));
+    if (!frame) {
+        pbuf_free(pb);
+        return -1;
+    }
+    hdr = (struct ethernet_hdr *)frame->data;
     memcpy(hdr->dst, dst, ETHERNET_ADDR_LEN);
     memcpy(hdr->src, dev->addr, ETHERNET_ADDR_LEN);
     hdr->type = hton16(type);
-    memcpy(hdr + 1, payload, plen);
-    flen = sizeof(struct ethernet_hdr) + (plen < ETHERNET_PAYLOAD_SIZE_MIN ? ETHERNET_PAYLOAD_SIZE_MIN : plen);
+    flen = sizeof(struct ethernet_hdr) + plen;
 #ifdef DEBUG
     cprintf(">>> ethernet_tx <<<\n");
-    ethernet_dump(dev, frame, flen);
+    ethernet_dump(dev, frame->data, frame->len);
 #endif
-    return cb(dev, frame, flen) == (ssize_t)flen ? (ssize_t)plen : -1;
+    return cb(dev, frame) == (ssize_t)flen ? (ssize_t)plen : -1;
 }
 
 void
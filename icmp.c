@@ -4,6 +4,7 @@
 #include "types.h"
 #include "defs.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ip.h"
 #include "icmp.h"
 
@@ -99,44 +100,54 @@ icmp_dump (struct netif *netif, ip_addr_t *src, ip_addr_t *dst, uint8_t *packet,
 }
 
 static void
-icmp_rx (uint8_t *packet, size_t plen, ip_addr_t *src, ip_addr_t *dst, struct netif *netif) {
+icmp_rx (struct pbuf *pb, ip_addr_t *src, ip_addr_t *dst, struct netif *netif) {
     struct icmp_hdr *hdr;
 
     (void)dst;
-    if (plen < sizeof(struct icmp_hdr)) {
+    if (pb->len < sizeof(struct icmp_hdr)) {
+        pbuf_free(pb);
         return;
     }
 #ifdef DEBUG
     cprintf(">>> icmp_rx <<<\n");
-    icmp_dump(netif, src, dst, packet, plen);
+    icmp_dump(netif, src, dst, pb->data, pb->len);
 #endif
-    hdr = (struct icmp_hdr *)packet;
+    hdr = (struct icmp_hdr *)pb->data;
     switch (hdr->type) {
     case ICMP_TYPE_ECHO:
-        icmp_tx(netif, ICMP_TYPE_ECHOREPLY, hdr->code, hdr->ih_values, hdr->data, plen - sizeof(struct icmp_hdr), src);
+        icmp_tx(netif, ICMP_TYPE_ECHOREPLY, hdr->code, hdr->ih_values, hdr->data, pb->len - sizeof(struct icmp_hdr), src);
         break;
     }
+    pbuf_free(pb);
 }
 
 int
 icmp_tx (struct netif *netif, uint8_t type, uint8_t code, uint32_t values, uint8_t *data, size_t len, ip_addr_t *dst) {
-    uint8_t buf[ICMP_BUFSIZ];
+    struct pbuf *pb;
     struct icmp_hdr *hdr;
-    size_t msg_len;
 
-    hdr = (struct icmp_hdr *)buf;
+    if (len > ICMP_BUFSIZ - sizeof(struct icmp_hdr)) {
+        return -1;
+    }
+    pb = pbuf_alloc();
+    if (!pb) {
+        return -1;
+    }
+    hdr = (struct icmp_hdr *)pbuf_put(pb, sizeof(struct icmp_hdr));
     hdr->type = type;
     hdr->code = code;
     hdr->sum = 0;
     hdr->ih_values = values;
-    memcpy(hdr->data, data, len);
-    msg_len = sizeof(struct icmp_hdr) + len;
-    hdr->sum = cksum16((uint16_t *)hdr, msg_len, 0);
+    if (pbuf_append(pb, data, len) == -1) {
+        pbuf_free(pb);
+        return -1;
+    }
+    hdr->sum = pbuf_cksum16(pb, 0);
 #ifdef DEBUG
     cprintf(">>> icmp_tx <<<\n");
-    icmp_dump(netif, NULL, dst, (uint8_t *)hdr, msg_len);
+    icmp_dump(netif, NULL, dst, pb->data, pb->len);
 #endif
-    return ip_tx(netif, IP_PROTOCOL_ICMP, (uint8_t *)hdr, msg_len, dst);
+    return ip_tx(netif, IP_PROTOCOL_ICMP, pb, dst);
 }
 
 int
@@ -84,6 +84,22 @@ display(const char *name)
         p = (uint8_t *)&((struct sockaddr_in *)&ifr.ifr_broadaddr)->sin_addr;
         printf(0, " broadcast %d.%d.%d.%d\n", p[0], p[1], p[2], p[3]);
     } while(0);
+    // interrupt coalescing
+    if (ioctl(fd, SIOCGIFCOALESCE, &ifr) == 0) {
+        printf(0, "\tcoalesce rx-frames %d rx-usecs %d rx-abs-usecs %d tx-usecs %d tx-abs-usecs %d itr-usecs %d\n",
+            ifr.ifr_coalesce.rx_frames, ifr.ifr_coalesce.rx_usecs, ifr.ifr_coalesce.rx_abs_usecs,
+            ifr.ifr_coalesce.tx_usecs, ifr.ifr_coalesce.tx_abs_usecs, ifr.ifr_coalesce.itr_usecs);
+    }
+    // descriptor rings
+    if (ioctl(fd, SIOCGIFRINGPARAM, &ifr) == 0) {
+        printf(0, "\tring rx %d tx %d (max rx %d tx %d)\n",
+            ifr.ifr_ringparam.rx_pending, ifr.ifr_ringparam.tx_pending,
+            ifr.ifr_ringparam.rx_max, ifr.ifr_ringparam.tx_max);
+    }
+    // counters
+    if (ioctl(fd, SIOCGIFSTATS, &ifr) == 0) {
+        printf(0, "\tRX dropped %d\n", ifr.ifr_stats.rx_dropped);
+    }
     close(fd);
 }
 
@@ -181,12 +197,89 @@ ifset(const char *name, ip_addr_t *addr, ip_addr_t *netmask)
     close(fd);
 }
 
+static void
+ifcoalesce(const char *name, const char *key, int val)
+{
+    int fd;
+    struct ifreq ifr;
+    uint16_t *field;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1)
+        return;
+    strcpy(ifr.ifr_name, name);
+    if (ioctl(fd, SIOCGIFCOALESCE, &ifr) == -1) {
+        close(fd);
+        printf(0, "ifconfig: ioctl(SIOCGIFCOALESCE) failure, interface=%s\n", name);
+        return;
+    }
+    if (strcmp(key, "rx-frames") == 0)
+        field = &ifr.ifr_coalesce.rx_frames;
+    else if (strcmp(key, "rx-usecs") == 0)
+        field = &ifr.ifr_coalesce.rx_usecs;
+    else if (strcmp(key, "rx-abs-usecs") == 0)
+        field = &ifr.ifr_coalesce.rx_abs_usecs;
+    else if (strcmp(key, "tx-usecs") == 0)
+        field = &ifr.ifr_coalesce.tx_usecs;
+    else if (strcmp(key, "tx-abs-usecs") == 0)
+        field = &ifr.ifr_coalesce.tx_abs_usecs;
+    else if (strcmp(key, "itr-usecs") == 0)
+        field = &ifr.ifr_coalesce.itr_usecs;
+    else {
+        close(fd);
+        printf(0, "ifconfig: unknown coalesce parameter %s\n", key);
+        return;
+    }
+    *field = val;
+    if (ioctl(fd, SIOCSIFCOALESCE, &ifr) == -1) {
+        close(fd);
+        printf(0, "ifconfig: ioctl(SIOCSIFCOALESCE) failure, interface=%s\n", name);
+        return;
+    }
+    close(fd);
+}
+
+static void
+ifring(const char *name, const char *key, int val)
+{
+    int fd;
+    struct ifreq ifr;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1)
+        return;
+    strcpy(ifr.ifr_name, name);
+    if (ioctl(fd, SIOCGIFRINGPARAM, &ifr) == -1) {
+        close(fd);
+        printf(0, "ifconfig: ioctl(SIOCGIFRINGPARAM) failure, interface=%s\n", name);
+        return;
+    }
+    if (strcmp(key, "rx") == 0)
+        ifr.ifr_ringparam.rx_pending = val;
+    else if (strcmp(key, "tx") == 0)
+        ifr.ifr_ringparam.tx_pending = val;
+    else {
+        close(fd);
+        printf(0, "ifconfig: unknown ring parameter %s\n", key);
+        return;
+    }
+    if (ioctl(fd, SIOCSIFRINGPARAM, &ifr) == -1) {
+        close(fd);
+        printf(0, "ifconfig: ioctl(SIOCSIFRINGPARAM) failure, interface=%s (is it down?)\n", name);
+        return;
+    }
+    close(fd);
+}
+
 static void
 usage(void)
 {
     printf(0, "usage: ifconfig interface [command|address]\n");
     printf(0, "           - command: up | down\n");
     printf(0, "           - address: ADDRESS/PREFIX | ADDRESS netmask NETMASK\n");
+    printf(0, "       ifconfig interface coalesce PARAM VALUE\n");
+    printf(0, "           - param: rx-frames | rx-usecs | rx-abs-usecs | tx-usecs | tx-abs-usecs | itr-usecs\n");
+    printf(0, "       ifconfig interface ring rx|tx SIZE (while down)\n");
     printf(0, "       ifconfig [-a]\n");
     exit();
 }
@@ -231,6 +324,14 @@ main(int argc, char *argv[])
         ifset(argv[1], &addr, &netmask);
         exit();
     }
+    if (argc == 5 && strcmp(argv[2], "coalesce") == 0) {
+        ifcoalesce(argv[1], argv[3], atoi(argv[4]));
+        exit();
+    }
+    if (argc == 5 && strcmp(argv[2], "ring") == 0) {
+        ifring(argv[1], argv[3], atoi(argv[4]));
+        exit();
+    }
     if (argc == 5) {
         if (ip_addr_pton(argv[2], &addr) == -1)
             usage();
@@ -5,6 +5,7 @@
 #include "defs.h"
 #include "spinlock.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ethernet.h"
 #include "ip.h"
 
@@ -23,7 +24,7 @@ struct ip_route {
 struct ip_protocol {
     struct ip_protocol *next;
     uint8_t type;
-    void (*handler)(uint8_t *payload, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *netif);
+    void (*handler)(struct pbuf *pb, ip_addr_t *src, ip_addr_t *dst, struct netif *netif);
 };
 
 struct ip_hdr {
@@ -164,7 +165,7 @@ ip_netif_alloc (ip_addr_t unicast, ip_addr_t netmask, ip_addr_t gateway) {
     struct netif_ip *iface;
     ip_addr_t gw;
 
-    iface = (struct netif_ip *)kalloc();
+    iface = (struct netif_ip *)kmalloc(sizeof(*iface));
     if (!iface) {
         return NULL;
     }
@@ -176,12 +177,12 @@ ip_netif_alloc (ip_addr_t unicast, ip_addr_t netmask, ip_addr_t gateway) {
     iface->network = iface->unicast & iface->netmask;
     iface->broadcast = iface->network | ~iface->netmask;
     if (ip_route_add(iface->network, iface->netmask, IP_ADDR_ANY, (struct netif *)iface) == -1) {
-        kfree((char*)iface);
+        kmfree(iface);
         return NULL;
     }
     if (gateway) {
         if (ip_route_add(IP_ADDR_ANY, IP_ADDR_ANY, gateway, (struct netif *)iface) == -1) {
-            kfree((char*)iface);
+            kmfree(iface);
             return NULL;
         }
     }
@@ -209,7 +210,7 @@ ip_netif_register (struct netdev *dev, const char *addr, const char *netmask, co
         return NULL;
     }
     if (netdev_add_netif(dev, netif) == -1) {
-        kfree((char*)netif);
+        kmfree(netif);
         return NULL;
     }
     return netif;
@@ -268,95 +269,105 @@ ip_netif_by_peer (ip_addr_t *peer) {
  */
 
 static void
-ip_rx (uint8_t *dgram, size_t dlen, struct netdev *dev) {
+ip_rx (struct pbuf *pb, struct netdev *dev) {
     struct ip_hdr *hdr;
     uint16_t hlen, offset;
     struct netif_ip *iface;
-    uint8_t *payload;
-    size_t plen;
     struct ip_protocol *protocol;
 
-    if (dlen < sizeof(struct ip_hdr)) {
-        return;
+    if (pb->len < sizeof(struct ip_hdr)) {
+        goto drop;
     }
-    hdr = (struct ip_hdr *)dgram;
+    hdr = (struct ip_hdr *)pb->data;
     if ((hdr->vhl >> 4) != IP_VERSION_IPV4) {
         cprintf("not ipv4 packet.\n");
-        return;
+        goto drop;
     }
     hlen = (hdr->vhl & 0x0f) << 2;
-    if (dlen < hlen || dlen < ntoh16(hdr->len)) {
+    if (pb->len < hlen || pb->len < ntoh16(hdr->len) || ntoh16(hdr->len) < hlen) {
         cprintf("ip packet length error.\n");
-        return;
+        goto drop;
     }
     if (cksum16((uint16_t *)hdr, hlen, 0) != 0) {
         cprintf("ip checksum error.\n");
-        return;
+        goto drop;
     }
     if (!hdr->ttl) {
         cprintf("ip packet was dead (TTL=0).\n");
-        return;
+        goto drop;
     }
     iface = (struct netif_ip *)netdev_get_netif(dev, NETIF_FAMILY_IPV4);
     if (!iface) {
         cprintf("ip unknown interface.\n");
-        return;
+        goto drop;
     }
     if (hdr->dst != iface->unicast) {
         if (hdr->dst != iface->broadcast && hdr->dst != IP_ADDR_BROADCAST) {
             /* for other host */
-            return;
+            goto drop;
         }
     }
 #ifdef DEBUG
     cprintf(">>> ip_rx <<<\n");
-    ip_dump((struct netif *)iface, dgram, dlen);
+    ip_dump((struct netif *)iface, pb->data, pb->len);
 #endif
-    payload = (uint8_t *)hdr + hlen;
-    plen = ntoh16(hdr->len) - hlen;
     offset = ntoh16(hdr->offset);
     if (offset & 0x2000 || offset & 0x1fff) {
         /* fragments */
         cprintf("don't support IP fragments\n");
-        return;
+        goto drop;
     }
+    /* the header stays in the buffer, so src/dst remain valid for the handler */
+    pbuf_trim(pb, ntoh16(hdr->len));
+    pbuf_pull(pb, hlen);
     for (protocol = protocols; protocol; protocol = protocol->next) {
         if (protocol->type == hdr->protocol) {
-            protocol->handler(payload, plen, &hdr->src, &hdr->dst, (struct netif *)iface);
-            break;
+            protocol->handler(pb, &hdr->src, &hdr->dst, (struct netif *)iface);
+            return;
         }
     }
+drop:
+    pbuf_free(pb);
 }
 
 static int
-ip_tx_netdev (struct netif *netif, uint8_t *packet, size_t plen, const ip_addr_t *dst) {
+ip_tx_netdev (struct netif *netif, struct pbuf *pb, const ip_addr_t *dst) {
     uint8_t ha[128] = {};
     ssize_t ret;
 
     if (!(netif->dev->flags & NETDEV_FLAG_NOARP)) {
         if (dst) {
-            ret = arp_resolve(netif, dst, (void *)ha, packet, plen);
+            ret = arp_resolve(netif, dst, (void *)ha, NULL, 0);
             if (ret != 1) {
+                pbuf_free(pb);
                 return ret;
             }
         } else {
             memcpy(ha, netif->dev->broadcast, netif->dev->alen);
         }
     }
-    if (netif->dev->ops->xmit(netif->dev, ETHERNET_TYPE_IP, packet, plen, (void *)ha) != (ssize_t)plen) {
+    if (netif->dev->ops->xmit(netif->dev, ETHERNET_TYPE_IP, pb, (void *)ha) == -1) {
         return -1;
     }
     return 1;
 }
 
+/* Consumes pb; the header goes into its headroom. */
 static int
-ip_tx_core (struct netif *netif, uint8_t protocol, const uint8_t *buf, size_t len, const ip_addr_t *src, const ip_addr_t *dst, const ip_addr_t *nexthop, uint16_t id, uint16_t offset) {
-    uint8_t packet[4096];
+ip_tx_core (struct netif *netif, uint8_t protocol, struct pbuf *pb, const ip_addr_t *src, const ip_addr_t *dst, const ip_addr_t *nexthop, uint16_t id, uint16_t offset) {
+    struct pbuf *packet;
     struct ip_hdr *hdr;
     uint16_t hlen;
+    size_t len;
 
-    hdr = (struct ip_hdr *)packet;
+    len = pbuf_length(pb);
     hlen = sizeof(struct ip_hdr);
+    packet = pbuf_prepend(pb, hlen);
+    if (!packet) {
+        pbuf_free(pb);
+        return -1;
+    }
+    hdr = (struct ip_hdr *)packet->data;
     hdr->vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
     hdr->tos = 0;
     hdr->len = hton16(hlen + len);
@@ -368,12 +379,11 @@ ip_tx_core (struct netif *netif, uint8_t protocol, const uint8_t *buf, size_t le
     hdr->src = src ? *src : ((struct netif_ip *)netif)->unicast;
     hdr->dst = *dst;
     hdr->sum = cksum16((uint16_t *)hdr, hlen, 0);
-    memcpy(hdr + 1, buf, len);
 #ifdef DEBUG
     cprintf(">>> ip_tx_core <<<\n");
-    ip_dump(netif, (uint8_t *)packet, hlen + len);
+    ip_dump(netif, packet->data, packet->len);
 #endif
-    return ip_tx_netdev(netif, (uint8_t *)packet, hlen + len, nexthop);
+    return ip_tx_netdev(netif, packet, nexthop);
 }
 
 static uint16_t
@@ -387,44 +397,73 @@ ip_generate_id (void) {
     return ret;
 }
 
-ssize_t
-ip_tx (struct netif *netif, uint8_t protocol, const uint8_t *buf, size_t len, const ip_addr_t *dst) {
+static struct netif *
+ip_tx_route (struct netif *netif, const ip_addr_t *dst, ip_addr_t **src, ip_addr_t **nexthop) {
     struct ip_route *route;
-    ip_addr_t *nexthop = NULL, *src = NULL;
-    uint16_t id, flag, offset;
-    size_t done, slen;
 
+    *src = NULL;
+    *nexthop = NULL;
     if (netif && *dst == IP_ADDR_BROADCAST) {
-        nexthop = NULL;
-    } else {
-        route = ip_route_lookup(NULL, dst);
-        if (!route) {
-            cprintf("ip no route to host.\n");
-            return -1;
-        }
-        if (netif) {
-            src = &((struct netif_ip *)netif)->unicast;
-        }
-        netif = route->netif;
-        nexthop = (ip_addr_t *)(route->nexthop ? &route->nexthop : dst);
+        return netif;
+    }
+    route = ip_route_lookup(NULL, dst);
+    if (!route) {
+        cprintf("ip no route to host.\n");
+        return NULL;
+    }
+    if (netif) {
+        *src = &((struct netif_ip *)netif)->unicast;
+    }
+    *nexthop = (ip_addr_t *)(route->nexthop ? &route->nexthop : dst);
+    return route->netif;
+}
+
+/*
+ * Send the packet in pb (consumed), fragmenting it if it does not fit
+ * the MTU. Fragments need their own headers, so their data is copied.
+ */
+ssize_t
+ip_tx (struct netif *netif, uint8_t protocol, struct pbuf *pb, const ip_addr_t *dst) {
+    ip_addr_t *nexthop, *src;
+    uint16_t id, flag, offset;
+    size_t len, done, slen, mtu;
+    struct pbuf *frag;
+
+    len = pbuf_length(pb);
+    netif = ip_tx_route(netif, dst, &src, &nexthop);
+    if (!netif) {
+        pbuf_free(pb);
+        return -1;
     }
     id = ip_generate_id();
+    mtu = netif->dev->mtu - IP_HDR_SIZE_MIN;
+    if (len <= mtu) {
+        return ip_tx_core(netif, protocol, pb, src, dst, nexthop, id, 0) == -1 ? -1 : (ssize_t)len;
+    }
     for (done = 0; done < len; done += slen) {
-        slen = MIN((len - done), (size_t)(netif->dev->mtu - IP_HDR_SIZE_MIN));
+        slen = MIN(len - done, mtu & ~7);
         flag = ((done + slen) < len) ? 0x2000 : 0x0000;
         offset = flag | ((done >> 3) & 0x1fff);
-        if (ip_tx_core(netif, protocol, buf + done, slen, src, dst, nexthop, id, offset) == -1) {
+        frag = pbuf_alloc();
+        if (!frag) {
+            pbuf_free(pb);
+            return -1;
+        }
+        pbuf_copydata(pb, done, slen, pbuf_put(frag, slen));
+        if (ip_tx_core(netif, protocol, frag, src, dst, nexthop, id, offset) == -1) {
+            pbuf_free(pb);
             return -1;
         }
     }
+    pbuf_free(pb);
     return len;
 }
 
 int
-ip_add_protocol (uint8_t type, void (*handler)(uint8_t *payload, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *netif)) {
+ip_add_protocol (uint8_t type, void (*handler)(struct pbuf *pb, ip_addr_t *src, ip_addr_t *dst, struct netif *netif)) {
     struct ip_protocol *p;
 
-    p = (struct ip_protocol *)kalloc();
+    p = (struct ip_protocol *)kmalloc(sizeof(*p));
     if (!p) {
         return -1;
     }
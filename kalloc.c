@@ -8,6 +8,10 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "proc.h"
+
+#define KMEM_PCPU_MAX   64               // pages held per CPU at most
+#define KMEM_PCPU_BATCH (KMEM_PCPU_MAX/2) // pages moved per refill/drain
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
@@ -17,10 +21,19 @@ struct run {
   struct run *next;
 };
 
+// Each CPU keeps a short list of free pages so that most calls
+// to kalloc/kfree avoid kmem.lock. The lists are only used once
+// kinit2 has run; before that there is a single CPU and no lock.
+struct kmem_pcpu {
+  int n;
+  struct run *freelist;
+};
+
 struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  struct kmem_pcpu pcpu[NCPU];
 } kmem;
 
 // Initialization happens in two phases.
@@ -28,18 +41,29 @@ struct {
 // the pages mapped by entrypgdir on free list.
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
+// Each phase also hands a slice of its range to the buddy allocator
+// for multi-page allocations.
 void
 kinit1(void *vstart, void *vend)
 {
+  char *split;
+
   initlock(&kmem.lock, "kmem");
   kmem.use_lock = 0;
-  freerange(vstart, vend);
+  split = (char*)vend - BUDDY_BOOTSIZE;
+  buddyinit(split, vend);
+  freerange(vstart, split);
 }
 
 void
 kinit2(void *vstart, void *vend)
 {
-  freerange(vstart, vend);
+  char *split;
+
+  split = (char*)vstart + BUDDY_SIZE;
+  buddyinit(vstart, split);
+  freerange(split, vend);
+  buddyinit2();
   kmem.use_lock = 1;
 }
 
@@ -59,21 +83,42 @@ freerange(void *vstart, void *vend)
 void
 kfree(char *v)
 {
-  struct run *r;
+  struct run *r, *head, *tail;
+  struct kmem_pcpu *c;
+  int i;
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+#ifdef KALLOC_DEBUG
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
+#endif
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
+  if(!kmem.use_lock){
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+    return;
+  }
+
+  pushcli();
+  c = &kmem.pcpu[cpuid()];
+  r->next = c->freelist;
+  c->freelist = r;
+  if(++c->n > KMEM_PCPU_MAX){
+    // Give a batch back to the global list.
+    head = tail = c->freelist;
+    for(i = 1; i < KMEM_PCPU_BATCH; i++)
+      tail = tail->next;
+    c->freelist = tail->next;
+    c->n -= KMEM_PCPU_BATCH;
+    acquire(&kmem.lock);
+    tail->next = kmem.freelist;
+    kmem.freelist = head;
     release(&kmem.lock);
+  }
+  popcli();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -83,14 +128,33 @@ char*
 kalloc(void)
 {
   struct run *r;
+  struct kmem_pcpu *c;
+
+  if(!kmem.use_lock){
+    r = kmem.freelist;
+    if(r)
+      kmem.freelist = r->next;
+    return (char*)r;
+  }
 
-  if(kmem.use_lock)
+  pushcli();
+  c = &kmem.pcpu[cpuid()];
+  if(c->freelist == 0){
+    // Refill from the global list.
     acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
+    while(c->n < KMEM_PCPU_BATCH && (r = kmem.freelist) != 0){
+      kmem.freelist = r->next;
+      r->next = c->freelist;
+      c->freelist = r;
+      c->n++;
+    }
     release(&kmem.lock);
+  }
+  r = c->freelist;
+  if(r){
+    c->freelist = r->next;
+    c->n--;
+  }
+  popcli();
   return (char*)r;
 }
-
@@ -27,15 +27,19 @@ main(void)
   consoleinit();   // console hardware
   uartinit();      // serial port
   pinit();         // process table
+  slabinit();      // kernel object caches
   tvinit();        // trap vectors
   binit();         // buffer cache
   fileinit();      // file table
   ideinit();       // disk 
   pciinit();       // pci devices
+  timerinit();     // kernel timers
   netinit();       // networking
   startothers();   // start other processors
   kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
   userinit();      // first user process
+  timerstart();    // kernel timer thread
+  netstart();      // network kernel threads
   mpmain();        // finish this processor's setup
 }
 
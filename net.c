@@ -3,7 +3,12 @@
 
 #include "types.h"
 #include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ip.h"
 
 #define DEBUG
@@ -11,12 +16,29 @@
 struct netproto {
     struct netproto *next;
     uint16_t type;
-    void (*handler)(uint8_t *packet, size_t plen, struct netdev *dev);
+    void (*handler)(struct pbuf *pb, struct netdev *dev);
 };
 
 static struct netdev *devices;
 static struct netproto *protocols;
 
+// Devices waiting for the poller, in FIFO order
+static struct {
+    struct spinlock lock;
+    struct netdev *head;
+    struct netdev *tail;
+} pollq;
+
+// Received frames waiting for protocol processing, one queue per
+// receive worker thread and as many workers as CPUs
+static struct netrx_backlog {
+    struct spinlock lock;
+    struct pbuf *head;
+    struct pbuf *tail;
+    int len;
+} backlogs[NCPU];
+static int nbacklogs;
+
 struct netdev *
 netdev_root(void)
 {
@@ -29,12 +51,13 @@ netdev_alloc(void (*setup)(struct netdev *))
     struct netdev *dev;
     static unsigned int index = 0;
 
-    dev = (struct netdev *)kalloc();
+    dev = (struct netdev *)kmalloc(sizeof(*dev));
     if (!dev) {
         return NULL;
     }
     memset(dev, 0, sizeof(struct netdev));
     dev->index = index++;
+    dev->poll_weight = NETDEV_POLL_WEIGHT;
     snprintf(dev->name, sizeof(dev->name), "net%d", dev->index);
     setup(dev);
     return dev;
@@ -73,19 +96,102 @@ netdev_by_name(const char *name)
     return NULL;
 }
 
-void
-netdev_receive(struct netdev *dev, uint16_t type, uint8_t *packet, unsigned int plen)
+// Run the protocol handler for a frame. The handler takes ownership
+// of pb and must free it.
+static void
+netdev_deliver(struct netdev *dev, uint16_t type, struct pbuf *pb)
 {
     struct netproto *entry;
 #ifdef DEBUG
-    cprintf("[net] netdev_receive: dev=%s, type=%04x, packet=%p, plen=%u\n", dev->name, type, packet, plen);
+    cprintf("[net] netdev_deliver: dev=%s, type=%04x, packet=%p, plen=%u\n", dev->name, type, pb->data, pb->len);
 #endif
     for (entry = protocols; entry; entry = entry->next) {
         if (hton16(entry->type) == type) {
-            entry->handler(packet, plen, dev);
+            entry->handler(pb, dev);
             return;
         }
     }
+    pbuf_free(pb);
+}
+
+/*
+ * Hash the addresses, protocol and ports of an IPv4 packet, so that
+ * every packet of a flow goes to the same backlog and stays in order.
+ * Fragments leave the ports out: only the first one carries them.
+ * Everything else goes to the first backlog.
+ */
+static uint32_t
+netrx_flow_hash(uint16_t type, struct pbuf *pb)
+{
+    uint8_t *p = pb->data;
+    uint32_t h;
+    size_t hl;
+
+    if (type != hton16(NETPROTO_TYPE_IP) || pb->len < 20)
+        return 0;
+    hl = (p[0] & 0x0f) << 2;
+    h = *(uint32_t *)(p + 12) ^ *(uint32_t *)(p + 16) ^ p[9];
+    if ((p[9] == IP_PROTOCOL_TCP || p[9] == IP_PROTOCOL_UDP) &&
+        !(ntoh16(*(uint16_t *)(p + 6)) & 0x3fff) && pb->len >= hl + 4)
+        h ^= *(uint32_t *)(p + hl);
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h;
+}
+
+// Called by drivers for each received frame. Queues pb for a receive
+// worker, which runs the protocol handler; pb is freed if the queue
+// is full.
+void
+netdev_receive(struct netdev *dev, uint16_t type, struct pbuf *pb)
+{
+    struct netrx_backlog *q;
+
+    q = &backlogs[nbacklogs > 1 ? netrx_flow_hash(type, pb) % nbacklogs : 0];
+    acquire(&q->lock);
+    if (q->len >= NETRX_BACKLOG_MAX) {
+        dev->rx_dropped++;
+        release(&q->lock);
+        pbuf_free(pb);
+        return;
+    }
+    pb->dev = dev;
+    pb->type = type;
+    pb->next = NULL;
+    if (q->tail)
+        q->tail->next = pb;
+    else
+        q->head = pb;
+    q->tail = pb;
+    if (q->len++ == 0)
+        wakeup(q);
+    release(&q->lock);
+}
+
+// Takes everything queued on its backlog at once and delivers it
+// without holding the queue lock.
+static void
+netrx_worker(void *arg)
+{
+    struct netrx_backlog *q = arg;
+    struct pbuf *pb, *next;
+
+    acquire(&q->lock);
+    for (;;) {
+        while (!q->head)
+            sleep(q, &q->lock);
+        pb = q->head;
+        q->head = q->tail = NULL;
+        q->len = 0;
+        release(&q->lock);
+        for (; pb; pb = next) {
+            next = pb->next;
+            pb->next = NULL;
+            netdev_deliver(pb->dev, pb->type, pb);
+        }
+        acquire(&q->lock);
+    }
 }
 
 int
@@ -124,7 +230,7 @@ netdev_get_netif(struct netdev *dev, int family)
 }
 
 int
-netproto_register(unsigned short type, void (*handler)(uint8_t *packet, size_t plen, struct netdev *dev))
+netproto_register(unsigned short type, void (*handler)(struct pbuf *pb, struct netdev *dev))
 {
     struct netproto *entry;
 
@@ -133,7 +239,7 @@ netproto_register(unsigned short type, void (*handler)(uint8_t *packet, size_t p
             return -1;
         }
     }
-    entry = (struct netproto *)kalloc();
+    entry = (struct netproto *)kmalloc(sizeof(*entry));
     if (!entry) {
         return -1;
     }
@@ -144,12 +250,101 @@ netproto_register(unsigned short type, void (*handler)(uint8_t *packet, size_t p
     return 0;
 }
 
+static void
+netdev_poll_enqueue(struct netdev *dev)
+{
+    dev->poll_next = NULL;
+    if (pollq.tail)
+        pollq.tail->poll_next = dev;
+    else
+        pollq.head = dev;
+    pollq.tail = dev;
+}
+
+/*
+ * Called by a driver, typically from its interrupt handler after masking
+ * receive interrupts, to have dev->ops->poll run by the poller thread.
+ */
+void
+netdev_poll_schedule(struct netdev *dev)
+{
+    acquire(&pollq.lock);
+    if (!dev->poll_scheduled) {
+        dev->poll_scheduled = 1;
+        netdev_poll_enqueue(dev);
+        wakeup(&pollq);
+    }
+    release(&pollq.lock);
+}
+
+/*
+ * Called by dev->ops->poll when it has drained the device before using up
+ * its budget, before the driver unmasks receive interrupts again.
+ */
+void
+netdev_poll_complete(struct netdev *dev)
+{
+    acquire(&pollq.lock);
+    dev->poll_scheduled = 0;
+    release(&pollq.lock);
+}
+
+static void
+netdev_poll_thread(void *arg)
+{
+    struct netdev *dev;
+    int work;
+
+    acquire(&pollq.lock);
+    for (;;) {
+        while (!pollq.head)
+            sleep(&pollq, &pollq.lock);
+        dev = pollq.head;
+        pollq.head = dev->poll_next;
+        if (!pollq.head)
+            pollq.tail = NULL;
+        release(&pollq.lock);
+        work = dev->ops->poll(dev, dev->poll_weight);
+        acquire(&pollq.lock);
+        if (work >= dev->poll_weight) {
+            // budget exhausted: go to the back of the queue and
+            // give user processes a chance to run before the next round
+            netdev_poll_enqueue(dev);
+            release(&pollq.lock);
+            yield();
+            acquire(&pollq.lock);
+        }
+    }
+}
+
 void
 netinit(void)
 {
+    int i;
+
+    initlock(&pollq.lock, "netpoll");
+    nbacklogs = ncpu > 0 ? ncpu : 1;
+    for (i = 0; i < nbacklogs; i++)
+        initlock(&backlogs[i].lock, "netrx");
+    pbuf_init();
     arp_init();
     ip_init();
     icmp_init();
     udp_init();
     tcp_init();
 }
+
+void
+netstart(void)
+{
+    char name[16];
+    int i;
+
+    if (kthread_create(netdev_poll_thread, NULL, "netpoll") == -1)
+        panic("netstart: kthread_create");
+    for (i = 0; i < nbacklogs; i++) {
+        snprintf(name, sizeof(name), "netrx%d", i);
+        if (kthread_create(netrx_worker, &backlogs[i], name) == -1)
+            panic("netstart: kthread_create");
+    }
+}
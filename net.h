@@ -19,11 +19,17 @@
 #define NETIF_FAMILY_IPV4     (0x02)
 #define NETIF_FAMILY_IPV6     (0x0a)
 
+#define NETDEV_POLL_WEIGHT    64 /* frames per poll round */
+#define NETRX_BACKLOG_MAX   1000 /* frames queued per receive worker before dropping */
+
 #ifndef IFNAMSIZ
 #define IFNAMSIZ 16
 #endif
 
 struct netdev;
+struct ifcoalesce;
+struct ifringparam;
+struct pbuf;
 
 struct netif {
     struct netif *next;
@@ -35,7 +41,14 @@ struct netif {
 struct netdev_ops {
     int (*open)(struct netdev *dev);
     int (*stop)(struct netdev *dev);
-    int (*xmit)(struct netdev *dev, uint16_t type, const uint8_t *packet, size_t size, const void *dst);
+    /* consumes pb; returns the number of bytes sent or -1 */
+    int (*xmit)(struct netdev *dev, uint16_t type, struct pbuf *pb, const void *dst);
+    int (*poll)(struct netdev *dev, int budget);
+    int (*get_coalesce)(struct netdev *dev, struct ifcoalesce *ic);
+    int (*set_coalesce)(struct netdev *dev, const struct ifcoalesce *ic);
+    int (*get_ringparam)(struct netdev *dev, struct ifringparam *rp);
+    /* only while the device is down */
+    int (*set_ringparam)(struct netdev *dev, const struct ifringparam *rp);
 };
 
 struct netdev {
@@ -53,4 +66,10 @@ struct netdev {
     uint8_t broadcast[16];
     struct netdev_ops *ops;
     void *priv;
+    /* receive polling */
+    struct netdev *poll_next;
+    int poll_weight;
+    int poll_scheduled;
+    /* counters */
+    uint32_t rx_dropped; /* frames dropped on a full receive backlog */
 };
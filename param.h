@@ -12,3 +12,6 @@
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
 
+#define BUDDY_MAX_ORDER 10  // largest contiguous allocation is 2^10 pages
+#define BUDDY_BOOTSIZE (1024*1024)    // contiguous memory available before kinit2
+#define BUDDY_SIZE     (8*1024*1024)  // contiguous memory added by kinit2
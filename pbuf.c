@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: MIT
+
+#include "types.h"
+#include "defs.h"
+#include "spinlock.h"
+#include "pbuf.h"
+
+// Free buffers are kept here rather than returned to kalloc, so the
+// network stack does not compete with the rest of the kernel for pages
+// while it is busy.
+static struct {
+    struct spinlock lock;
+    struct pbuf *free;
+    int nfree;
+} pool;
+
+// Returns an empty pbuf with PBUF_HEADROOM reserved in front of data.
+struct pbuf *
+pbuf_alloc(void)
+{
+    struct pbuf *pb;
+
+    acquire(&pool.lock);
+    pb = pool.free;
+    if (pb) {
+        pool.free = pb->next;
+        pool.nfree--;
+    }
+    release(&pool.lock);
+    if (!pb) {
+        pb = (struct pbuf *)kalloc();
+        if (!pb) {
+            return NULL;
+        }
+    }
+    pb->next = NULL;
+    pb->frag = NULL;
+    pb->data = pb->buf + PBUF_HEADROOM;
+    pb->len = 0;
+    pb->ref = 1;
+    return pb;
+}
+
+static void
+pbuf_release(struct pbuf *pb)
+{
+    acquire(&pool.lock);
+    if (pool.nfree < PBUF_POOL_MAX) {
+        pb->next = pool.free;
+        pool.free = pb;
+        pool.nfree++;
+        pb = NULL;
+    }
+    release(&pool.lock);
+    if (pb) {
+        kfree((char *)pb);
+    }
+}
+
+// Take another reference to pb (and, through it, its fragments).
+struct pbuf *
+pbuf_ref(struct pbuf *pb)
+{
+    __sync_fetch_and_add(&pb->ref, 1);
+    return pb;
+}
+
+// Drop a reference to pb, releasing it and its fragments once unused.
+void
+pbuf_free(struct pbuf *pb)
+{
+    struct pbuf *frag;
+
+    while (pb) {
+        if (__sync_sub_and_fetch(&pb->ref, 1) > 0) {
+            break;
+        }
+        frag = pb->frag;
+        pbuf_release(pb);
+        pb = frag;
+    }
+}
+
+
+// Strip len bytes from the front, returning the new start of data.
+uint8_t *
+pbuf_pull(struct pbuf *pb, size_t len)
+{
+    if (len > pb->len) {
+        return NULL;
+    }
+    pb->data += len;
+    pb->len -= len;
+    return pb->data;
+}
+
+// Prepend len bytes taken from the headroom, returning the new start of data.
+uint8_t *
+pbuf_push(struct pbuf *pb, size_t len)
+{
+    if (len > pbuf_headroom(pb)) {
+        return NULL;
+    }
+    pb->data -= len;
+    pb->len += len;
+    return pb->data;
+}
+
+// Append len bytes taken from the tailroom, returning where they start.
+uint8_t *
+pbuf_put(struct pbuf *pb, size_t len)
+{
+    uint8_t *tail;
+
+    if (len > pbuf_tailroom(pb)) {
+        return NULL;
+    }
+    tail = pb->data + pb->len;
+    pb->len += len;
+    return tail;
+}
+
+// Copy data to the end of a packet, filling the tailroom of its last
+// fragment and chaining new pbufs as needed. Fragments other than the
+// last are kept to even lengths so that pbuf_cksum16 works on the result.
+int
+pbuf_append(struct pbuf *pb, const void *data, size_t len)
+{
+    struct pbuf *last, *frag;
+    size_t n;
+
+    for (last = pb; last->frag; last = last->frag)
+        ;
+    while (len) {
+        n = MIN(pbuf_tailroom(last), len);
+        if (n < len && (last->len + n) & 1) {
+            n--;
+        }
+        if (n) {
+            memcpy(pbuf_put(last, n), data, n);
+            data = (const uint8_t *)data + n;
+            len -= n;
+        }
+        if (len) {
+            frag = pbuf_alloc();
+            if (!frag) {
+                return -1;
+            }
+            frag->data = frag->buf;
+            last->frag = frag;
+            last = frag;
+        }
+    }
+    return 0;
+}
+
+// Prepend len bytes to a packet, in the headroom of pb if there is
+// room and in a new header pbuf chained in front of it otherwise.
+// Returns the head of the packet, or NULL (pb is left untouched).
+struct pbuf *
+pbuf_prepend(struct pbuf *pb, size_t len)
+{
+    struct pbuf *head;
+
+    if (pb->ref == 1 && pbuf_push(pb, len)) {
+        return pb;
+    }
+    head = pbuf_alloc();
+    if (!head) {
+        return NULL;
+    }
+    pbuf_push(head, len);
+    head->frag = pb;
+    return head;
+}
+
+// Total number of bytes in a packet.
+size_t
+pbuf_length(struct pbuf *pb)
+{
+    size_t len = 0;
+
+    for (; pb; pb = pb->frag) {
+        len += pb->len;
+    }
+    return len;
+}
+
+// Copy len bytes starting at off within a packet into dst.
+size_t
+pbuf_copydata(struct pbuf *pb, size_t off, size_t len, void *dst)
+{
+    size_t n, done = 0;
+
+    for (; pb && done < len; pb = pb->frag) {
+        if (off >= pb->len) {
+            off -= pb->len;
+            continue;
+        }
+        n = MIN(pb->len - off, len - done);
+        memcpy((uint8_t *)dst + done, pb->data + off, n);
+        done += n;
+        off = 0;
+    }
+    return done;
+}
+
+// Internet checksum over a whole packet. Every fragment but
+// the last must have an even length.
+uint16_t
+pbuf_cksum16(struct pbuf *pb, uint32_t init)
+{
+    uint32_t sum = init;
+
+    for (; pb; pb = pb->frag) {
+        sum = (uint16_t)~cksum16((uint16_t *)pb->data, pb->len, sum);
+    }
+    return ~(uint16_t)sum;
+}
+
+// Drop anything beyond len bytes (e.g. link-layer padding).
+void
+pbuf_trim(struct pbuf *pb, size_t len)
+{
+    if (len < pb->len) {
+        pb->len = len;
+    }
+}
+
+void
+pbuf_init(void)
+{
+    struct pbuf *pb;
+
+    initlock(&pool.lock, "pbuf");
+    for (int n = 0; n < PBUF_POOL_RESERVE; n++) {
+        pb = (struct pbuf *)kalloc();
+        if (!pb) {
+            break;
+        }
+        pbuf_release(pb);
+    }
+}
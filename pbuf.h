@@ -0,0 +1,41 @@
+/*
+ * Packet buffer
+ *
+ * Each pbuf owns one page: this header followed by the buffer.
+ * data and len describe the valid bytes within buf. The space in
+ * front of data is headroom that headers are pushed into, and the
+ * space after it is tailroom that payload is put into.
+ *
+ * A packet may span several pbufs linked through frag, e.g. a
+ * header pbuf followed by a payload pbuf that is also held by a
+ * retransmission queue. A pbuf owns the reference to its frag.
+ */
+struct pbuf {
+    struct pbuf *next; /* next packet in a queue */
+    struct pbuf *frag; /* next fragment of this packet */
+    uint8_t *data;     /* first valid byte */
+    size_t len;        /* number of valid bytes */
+    int ref;
+    struct netdev *dev; /* receiving device, while queued for delivery */
+    uint16_t type;      /* its link-layer payload type, network order */
+    uint8_t buf[0] __attribute__((aligned(16)));
+};
+
+#define PBUF_SIZE 4096
+#define PBUF_BUFSIZE (PBUF_SIZE - sizeof(struct pbuf))
+#define PBUF_HEADROOM 128 /* link + network + transport headers */
+
+#define PBUF_POOL_RESERVE 64   /* buffers set aside at boot */
+#define PBUF_POOL_MAX     1024 /* free buffers kept before pages go back to kalloc */
+
+static inline size_t
+pbuf_headroom(struct pbuf *pb)
+{
+    return pb->data - pb->buf;
+}
+
+static inline size_t
+pbuf_tailroom(struct pbuf *pb)
+{
+    return PBUF_BUFSIZE - pbuf_headroom(pb) - pb->len;
+}
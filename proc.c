@@ -115,6 +115,54 @@ found:
   return p;
 }
 
+// First code run by a kernel thread, entered from forkret.
+static void
+kthread_main(void (*fn)(void*), void *arg)
+{
+  fn(arg);
+  panic("kthread returned");
+}
+
+// Create a kernel thread running fn(arg).
+// It has no user memory or open files, and fn must never return.
+int
+kthread_create(void (*fn)(void*), void *arg, char *name)
+{
+  struct proc *p;
+  uint *sp;
+
+  if((p = allocproc()) == 0)
+    return -1;
+  if((p->pgdir = setupkvm()) == 0){
+    kfree(p->kstack);
+    p->kstack = 0;
+    p->state = UNUSED;
+    return -1;
+  }
+
+  // Build the stack below the unused trap frame so that
+  // forkret "returns" to kthread_main(fn, arg) instead of trapret.
+  sp = (uint*)p->tf;
+  *--sp = (uint)arg;
+  *--sp = (uint)fn;
+  *--sp = 0;  // fake return PC
+  *--sp = (uint)kthread_main;
+
+  p->context = (struct context*)sp - 1;
+  memset(p->context, 0, sizeof *p->context);
+  p->context->eip = (uint)forkret;
+
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+
+  p->state = RUNNABLE;
+
+  release(&ptable.lock);
+
+  return p->pid;
+}
+
 //PAGEBREAK: 32
 // Set up first user process.
 void
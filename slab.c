@@ -0,0 +1,260 @@
+// Object caches for small kernel structures.
+//
+// kalloc() only hands out whole pages, which is wasteful for the
+// queue entries, control blocks and sockets that the network stack
+// allocates per packet or per connection.  A kmem_cache carves pages
+// into equal-sized objects.  Each page (a slab) starts with a small
+// header naming its cache, so kmfree() can find the cache from the
+// object address alone.
+//
+// Every cache also keeps a magazine of free objects per CPU; the common
+// alloc/free path touches only that magazine with interrupts off and
+// never takes the cache lock.  Magazines are refilled from and flushed
+// back to the slabs KMEM_MAG_BATCH objects at a time.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+
+#define KMEM_MAG_SIZE   16                 // objects per CPU magazine
+#define KMEM_MAG_BATCH  (KMEM_MAG_SIZE/2)  // objects moved per refill/flush
+#define KMEM_MAX_CACHES 32
+#define KMEM_ALIGN      8
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *prev;  // on cache->partial while it has free objects
+  struct slab *next;
+  void *free;         // free object list
+  uint inuse;
+  uint onlist;
+};
+
+struct kmem_magazine {
+  int n;
+  void *objs[KMEM_MAG_SIZE];
+};
+
+struct kmem_cache {
+  char name[16];
+  uint size;            // object size, rounded up to KMEM_ALIGN
+  uint perslab;         // objects per slab page
+  struct spinlock lock;
+  struct slab *partial; // slabs with at least one free object
+  uint nempty;          // slabs on partial with no objects in use
+  uint nslabs;
+  struct kmem_magazine mag[NCPU];
+};
+
+static struct {
+  struct spinlock lock;
+  int n;
+  struct kmem_cache caches[KMEM_MAX_CACHES];
+} kmem_caches;
+
+// General-purpose size classes used by kmalloc().
+static uint kmalloc_sizes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+static struct kmem_cache *kmalloc_caches[NELEM(kmalloc_sizes)];
+
+#define SLAB_HDRSIZE ((sizeof(struct slab) + KMEM_ALIGN-1) & ~(KMEM_ALIGN-1))
+
+void
+slabinit(void)
+{
+  char name[16];
+  int i;
+
+  initlock(&kmem_caches.lock, "kmem_caches");
+  for(i = 0; i < NELEM(kmalloc_sizes); i++){
+    snprintf(name, sizeof(name), "kmalloc-%d", kmalloc_sizes[i]);
+    kmalloc_caches[i] = kmem_cache_create(name, kmalloc_sizes[i]);
+    if(kmalloc_caches[i] == 0)
+      panic("slabinit");
+  }
+}
+
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  if(size < sizeof(void*))
+    size = sizeof(void*);
+  size = (size + KMEM_ALIGN-1) & ~(KMEM_ALIGN-1);
+  if(size > PGSIZE - SLAB_HDRSIZE)
+    return 0;
+  acquire(&kmem_caches.lock);
+  if(kmem_caches.n == KMEM_MAX_CACHES){
+    release(&kmem_caches.lock);
+    return 0;
+  }
+  c = &kmem_caches.caches[kmem_caches.n++];
+  release(&kmem_caches.lock);
+
+  memset(c, 0, sizeof(*c));
+  safestrcpy(c->name, name, sizeof(c->name));
+  c->size = size;
+  c->perslab = (PGSIZE - SLAB_HDRSIZE) / size;
+  initlock(&c->lock, c->name);
+  return c;
+}
+
+static void
+slab_link(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+  s->onlist = 1;
+}
+
+static void
+slab_unlink(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+  s->onlist = 0;
+}
+
+// Carve a fresh page into objects. Caller holds c->lock.
+static struct slab*
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *p;
+  uint i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->free = 0;
+  s->inuse = 0;
+  p = (char*)s + SLAB_HDRSIZE + (c->perslab - 1) * c->size;
+  for(i = 0; i < c->perslab; i++, p -= c->size){
+    *(void**)p = s->free;
+    s->free = p;
+  }
+  slab_link(c, s);
+  c->nempty++;
+  c->nslabs++;
+  return s;
+}
+
+// Take up to n objects from the slabs. Caller holds c->lock.
+static int
+slab_get(struct kmem_cache *c, void **objs, int n)
+{
+  struct slab *s;
+  int got;
+
+  for(got = 0; got < n; got++){
+    if((s = c->partial) == 0 && (s = slab_grow(c)) == 0)
+      break;
+    objs[got] = s->free;
+    s->free = *(void**)s->free;
+    if(s->inuse++ == 0)
+      c->nempty--;
+    if(s->free == 0)
+      slab_unlink(c, s);
+  }
+  return got;
+}
+
+// Return an object to its slab. Keeps at most one empty slab
+// per cache and gives the rest back to kalloc. Caller holds c->lock.
+static void
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s;
+
+  s = (struct slab*)PGROUNDDOWN((uint)obj);
+  if(s->cache != c)
+    panic("kmem_cache_free");
+  *(void**)obj = s->free;
+  s->free = obj;
+  if(!s->onlist)
+    slab_link(c, s);
+  if(--s->inuse > 0)
+    return;
+  if(c->nempty > 0){
+    slab_unlink(c, s);
+    c->nslabs--;
+    kfree((char*)s);
+    return;
+  }
+  c->nempty++;
+}
+
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct kmem_magazine *m;
+  void *obj;
+
+  pushcli();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    acquire(&c->lock);
+    m->n = slab_get(c, m->objs, KMEM_MAG_BATCH);
+    release(&c->lock);
+  }
+  obj = m->n > 0 ? m->objs[--m->n] : 0;
+  popcli();
+  return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct kmem_magazine *m;
+  int i;
+
+  if(obj == 0)
+    return;
+  pushcli();
+  m = &c->mag[cpuid()];
+  if(m->n == KMEM_MAG_SIZE){
+    acquire(&c->lock);
+    for(i = 0; i < KMEM_MAG_BATCH; i++)
+      slab_put(c, m->objs[--m->n]);
+    release(&c->lock);
+  }
+  m->objs[m->n++] = obj;
+  popcli();
+}
+
+// Allocate size bytes from the smallest size class that fits.
+// Returns 0 if size is larger than the biggest class.
+void*
+kmalloc(uint size)
+{
+  int i;
+
+  for(i = 0; i < NELEM(kmalloc_sizes); i++){
+    if(size <= kmalloc_sizes[i])
+      return kmem_cache_alloc(kmalloc_caches[i]);
+  }
+  return 0;
+}
+
+// Free an object from kmalloc() or any kmem_cache.
+void
+kmfree(void *obj)
+{
+  struct slab *s;
+
+  if(obj == 0)
+    return;
+  s = (struct slab*)PGROUNDDOWN((uint)obj);
+  kmem_cache_free(s->cache, obj);
+}
@@ -29,7 +29,7 @@ socketalloc(int domain, int type, int protocol) {
     if (!f) {
         return NULL;
     }
-    s = (struct socket *)kalloc();
+    s = (struct socket *)kmalloc(sizeof(*s));
     if (!s) {
         fileclose(f);
         return NULL;
@@ -49,6 +49,7 @@ socketclose(struct socket *s) {
         tcp_api_close(s->desc);
     else
         udp_api_close(s->desc);
+    kmfree(s);
 }
 
 int
@@ -84,7 +85,7 @@ socketaccept(struct socket *s, struct sockaddr *addr, int *addrlen) {
     if (!f) {
         return NULL;
     }
-    as = (struct socket *)kalloc();
+    as = (struct socket *)kmalloc(sizeof(*s));
     if (!as) {
         fileclose(f);
         return NULL;
@@ -92,7 +93,7 @@ socketaccept(struct socket *s, struct sockaddr *addr, int *addrlen) {
     adesc = tcp_api_accept(s->desc, addr, addrlen);
     if (adesc == -1) {
         fileclose(f);
-        kfree((void*)as);
+        kmfree(as);
         return NULL;
     }
     as->type = s->type;
@@ -132,6 +133,13 @@ socketsendto(struct socket *s, char *buf, int n, struct sockaddr *addr, int addr
     return udp_api_sendto(s->desc, (uint8_t *)buf, n, addr, addrlen);
 }
 
+int
+socketsetsockopt(struct socket *s, int level, int name, void *val, int len) {
+    if (s->type != SOCK_STREAM)
+        return -1;
+    return tcp_api_setsockopt(s->desc, level, name, val, len);
+}
+
 int
 socketioctl(struct socket *s, int req, void *arg) {
     struct ifreq *ifreq;
@@ -255,6 +263,37 @@ socketioctl(struct socket *s, int req, void *arg) {
         break;
     case SIOCSIFMTU:
         break;
+    case SIOCGIFCOALESCE:
+        ifreq = (struct ifreq *)arg;
+        dev = netdev_by_name(ifreq->ifr_name);
+        if (!dev || !dev->ops->get_coalesce)
+            return -1;
+        return dev->ops->get_coalesce(dev, &ifreq->ifr_coalesce);
+    case SIOCSIFCOALESCE:
+        ifreq = (struct ifreq *)arg;
+        dev = netdev_by_name(ifreq->ifr_name);
+        if (!dev || !dev->ops->set_coalesce)
+            return -1;
+        return dev->ops->set_coalesce(dev, &ifreq->ifr_coalesce);
+    case SIOCGIFRINGPARAM:
+        ifreq = (struct ifreq *)arg;
+        dev = netdev_by_name(ifreq->ifr_name);
+        if (!dev || !dev->ops->get_ringparam)
+            return -1;
+        return dev->ops->get_ringparam(dev, &ifreq->ifr_ringparam);
+    case SIOCSIFRINGPARAM:
+        ifreq = (struct ifreq *)arg;
+        dev = netdev_by_name(ifreq->ifr_name);
+        if (!dev || !dev->ops->set_ringparam)
+            return -1;
+        return dev->ops->set_ringparam(dev, &ifreq->ifr_ringparam);
+    case SIOCGIFSTATS:
+        ifreq = (struct ifreq *)arg;
+        dev = netdev_by_name(ifreq->ifr_name);
+        if (!dev)
+            return -1;
+        ifreq->ifr_stats.rx_dropped = dev->rx_dropped;
+        break;
     default:
         return -1;
     }
@@ -14,6 +14,16 @@
 #define IPPROTO_TCP 0
 #define IPPROTO_UDP 0
 
+/* setsockopt levels and options */
+#define SOL_SOCKET  0xffff
+
+#define SO_SNDBUF   0x1001
+#define SO_RCVBUF   0x1002
+
+#define TCP_NODELAY    1  /* send small segments without waiting for ACKs */
+#define TCP_CORK       3  /* hold partial segments until uncorked */
+#define TCP_CONGESTION 13 /* congestion control algorithm, by name */
+
 #define INADDR_ANY ((ip_addr_t)0)
 
 struct sockaddr {
@@ -29,6 +39,29 @@ struct sockaddr_in {
 
 #define IFNAMSIZ 16
 
+/* Interrupt moderation, all times in microseconds (0 = disabled) */
+struct ifcoalesce {
+    uint16_t rx_frames;    /* pending frames that force an interrupt */
+    uint16_t rx_usecs;     /* delay after the last received frame */
+    uint16_t rx_abs_usecs; /* upper bound on delay after the first frame */
+    uint16_t tx_usecs;     /* delay after the last transmitted frame */
+    uint16_t tx_abs_usecs; /* upper bound on delay after the first frame */
+    uint16_t itr_usecs;    /* minimum interval between interrupts */
+};
+
+/* Descriptor ring sizes (like ethtool -g) */
+struct ifringparam {
+    uint16_t rx_max;     /* largest RX ring the device takes */
+    uint16_t tx_max;     /* largest TX ring the device takes */
+    uint16_t rx_pending; /* RX descriptors in use */
+    uint16_t tx_pending; /* TX descriptors in use */
+};
+
+/* Interface counters */
+struct ifstats {
+    uint32_t rx_dropped;   /* received frames dropped before protocol processing */
+};
+
 struct ifreq {
     char ifr_name[IFNAMSIZ]; /* Interface name */
     union {
@@ -45,5 +78,8 @@ struct ifreq {
         char            ifr_slave[IFNAMSIZ];
         char            ifr_newname[IFNAMSIZ];
         char           *ifr_data;
+        struct ifcoalesce ifr_coalesce;
+        struct ifstats  ifr_stats;
+        struct ifringparam ifr_ringparam;
     };
 };
@@ -15,3 +15,8 @@
 #define	SIOCSIFBRDADDR  _IOW('i', 12, struct ifreq)
 #define	SIOCGIFMTU     _IOWR('i', 13, struct ifreq)
 #define	SIOCSIFMTU      _IOW('i', 14, struct ifreq)
+#define	SIOCGIFCOALESCE _IOWR('i', 15, struct ifreq)
+#define	SIOCSIFCOALESCE  _IOW('i', 16, struct ifreq)
+#define	SIOCGIFSTATS   _IOWR('i', 17, struct ifreq)
+#define	SIOCGIFRINGPARAM _IOWR('i', 18, struct ifreq)
+#define	SIOCSIFRINGPARAM  _IOW('i', 19, struct ifreq)
@@ -0,0 +1,97 @@
+#include "types.h"
+#include "user.h"
+#include "socket.h"
+
+// setsockopt() checks. The SO_RCVBUF-after-connect check needs a TCP
+// server to connect to; pass its address, e.g. "sockopttest 10.0.2.2 7".
+
+#define SERVER_IP   "10.0.2.2"
+#define SERVER_PORT 7
+
+static int failures;
+
+static void
+check (char *what, int got, int want)
+{
+    if (got == want) {
+        printf(1, "ok   %s\n", what);
+    } else {
+        printf(1, "FAIL %s: got %d, want %d\n", what, got, want);
+        failures++;
+    }
+}
+
+static int
+setint (int soc, int level, int name, int v)
+{
+    return setsockopt(soc, level, name, &v, sizeof(v));
+}
+
+int
+main (int argc, char *argv[])
+{
+    int soc, ret;
+    struct sockaddr_in server;
+    ip_addr_t addr;
+    char *ip = SERVER_IP;
+    int port = SERVER_PORT;
+    char bogus[] = "bogus";
+    char cubic[] = "cubic";
+    char newreno[] = "newreno";
+
+    if (argc > 1)
+        ip = argv[1];
+    if (argc > 2)
+        port = atoi(argv[2]);
+
+    soc = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (soc == -1) {
+        printf(1, "socket: failure\n");
+        exit();
+    }
+    check("TCP_NODELAY on", setint(soc, IPPROTO_TCP, TCP_NODELAY, 1), 0);
+    check("TCP_NODELAY off", setint(soc, IPPROTO_TCP, TCP_NODELAY, 0), 0);
+    check("TCP_CORK on", setint(soc, IPPROTO_TCP, TCP_CORK, 1), 0);
+    check("TCP_CORK off", setint(soc, IPPROTO_TCP, TCP_CORK, 0), 0);
+    check("TCP_NODELAY short option", setsockopt(soc, IPPROTO_TCP, TCP_NODELAY, &port, 1), -1);
+    check("TCP_CONGESTION cubic", setsockopt(soc, IPPROTO_TCP, TCP_CONGESTION, cubic, strlen(cubic)), 0);
+    check("TCP_CONGESTION newreno", setsockopt(soc, IPPROTO_TCP, TCP_CONGESTION, newreno, strlen(newreno)), 0);
+    check("TCP_CONGESTION bogus", setsockopt(soc, IPPROTO_TCP, TCP_CONGESTION, bogus, strlen(bogus)), -1);
+    check("unknown TCP option", setint(soc, IPPROTO_TCP, 99, 1), -1);
+    check("SO_RCVBUF before connect", setint(soc, SOL_SOCKET, SO_RCVBUF, 16384), 0);
+    check("SO_SNDBUF before connect", setint(soc, SOL_SOCKET, SO_SNDBUF, 16384), 0);
+    check("SO_RCVBUF zero", setint(soc, SOL_SOCKET, SO_RCVBUF, 0), -1);
+    check("SO_RCVBUF too large", setint(soc, SOL_SOCKET, SO_RCVBUF, 64 * 1024 * 1024), -1);
+
+    if (ip_addr_pton(ip, &addr) == -1) {
+        printf(1, "bad address %s\n", ip);
+        exit();
+    }
+    server.sin_family = AF_INET;
+    server.sin_addr = addr;
+    server.sin_port = hton16(port);
+    ret = connect(soc, (struct sockaddr *)&server, sizeof(server));
+    if (ret == -1) {
+        printf(1, "skip SO_RCVBUF after connect: cannot reach %s:%d\n", ip, port);
+    } else {
+        check("SO_RCVBUF after connect", setint(soc, SOL_SOCKET, SO_RCVBUF, 16384), -1);
+        check("SO_SNDBUF after connect", setint(soc, SOL_SOCKET, SO_SNDBUF, 16384), -1);
+        check("TCP_NODELAY after connect", setint(soc, IPPROTO_TCP, TCP_NODELAY, 1), 0);
+    }
+    close(soc);
+
+    soc = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (soc == -1) {
+        printf(1, "socket: failure\n");
+        exit();
+    }
+    check("UDP socket", setint(soc, IPPROTO_TCP, TCP_NODELAY, 1), -1);
+    check("UDP SO_RCVBUF", setint(soc, SOL_SOCKET, SO_RCVBUF, 16384), -1);
+    close(soc);
+
+    if (failures)
+        printf(1, "sockopttest: %d FAILED\n", failures);
+    else
+        printf(1, "sockopttest: all passed\n");
+    exit();
+}
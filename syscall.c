@@ -114,6 +114,7 @@ extern int sys_recv(void);
 extern int sys_send(void);
 extern int sys_recvfrom(void);
 extern int sys_sendto(void);
+extern int sys_setsockopt(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -148,6 +149,7 @@ static int (*syscalls[])(void) = {
 [SYS_send]     sys_send,
 [SYS_recvfrom] sys_recvfrom,
 [SYS_sendto]   sys_sendto,
+[SYS_setsockopt] sys_setsockopt,
 };
 
 void
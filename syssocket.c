@@ -148,3 +148,17 @@ sys_sendto(void)
     return -1;
   return socketsendto(f->socket, p, n, addr, addrlen);
 }
+
+int
+sys_setsockopt(void)
+{
+  struct file *f;
+  int level, name, len;
+  char *val;
+
+  if (argfd(0, 0, &f) < 0 || argint(1, &level) < 0 || argint(2, &name) < 0 || argint(4, &len) < 0 || argptr(3, &val, len) < 0)
+    return -1;
+  if (f->type != FD_SOCKET)
+    return -1;
+  return socketsetsockopt(f->socket, level, name, val, len);
+}
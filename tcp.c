@@ -3,13 +3,65 @@
 
 #include "types.h"
 #include "defs.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "common.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ip.h"
 #include "socket.h"
+#include "tcp_cong.h"
+#include "timer.h"
 
-#define TCP_CB_TABLE_SIZE 16
+#define TCP_RCVBUF_DEFAULT 4096  /* receive buffer per connection */
+#define TCP_SNDBUF_DEFAULT 4096  /* data accepted by send() but not yet sent */
+#define TCP_MSS_DEFAULT    536
+#define TCP_MSS_MIN        64   /* floor for the peer's MSS, so options always fit */
+#define TCP_BUF_MIN        1024
+#define TCP_BUF_MAX        (256 * 1024) /* per buffer; they come from the shared buddy pool */
+
+/* retransmission timeout (RFC 6298), in timer ticks */
+#define TCP_RTO_INIT    100 /* 1s */
+#define TCP_RTO_MIN     100 /* 1s */
+#define TCP_RTO_MAX     6000 /* 60s */
+#define TCP_RETRIES_MAX 12 /* retransmissions of one segment before giving up */
+#define TCP_FIN_TIMEOUT 6000 /* 60s for a closed socket's peer to send its FIN */
+
+#define TCP_TIMEWAIT_LEN 6000 /* 2MSL with MSL = 30s */
+#define TCP_TIMEWAIT_MAX 4096 /* connections held in TIME_WAIT at once */
+
+#define TCP_DUPACK_THRESH 3
+
+#define TCP_DELACK_TIMEOUT 4 /* 40ms */
+#define TCP_DELACK_SEGS    2 /* ACK at least every second segment */
+
+#define TCP_OPT_EOL       0
+#define TCP_OPT_NOP       1
+#define TCP_OPT_MSS       2
+#define TCP_OPT_WS        3
+#define TCP_OPT_SACK_PERM 4
+#define TCP_OPT_SACK      5
+#define TCP_OPT_TS        8
+#define TCP_OPT_ENO       69
+
+#define TCP_OPT_LEN_MAX   40
+#define TCP_OPT_LEN_TS    12 /* NOP, NOP, kind, len, TSval, TSecr */
+#define TCP_WSCALE_MAX    14
+#define TCP_SACK_BLOCKS_MAX 4
+#define TCP_OOO_MAX       8 /* out-of-order ranges held per connection */
+#define TCP_PAWS_IDLE     (24 * 24 * 3600 * 100) /* 24 days in ticks (RFC 7323 5.5) */
+
+/* options in use on a connection, agreed in the handshake */
+#define TCP_OPT_F_WS   0x01
+#define TCP_OPT_F_TS   0x02
+#define TCP_OPT_F_SACK 0x04
+
+#define TCP_SYNACK_RETRIES  5
+#define TCP_SYNCOOKIE_PERIOD 6400 /* 64s in ticks; a cookie lives one to two periods */
+
+#define TCP_HASH_MIN 64   /* buckets per table at boot; a power of 2 */
+#define TCP_HASH_MAX 8192 /* where the tables stop doubling */
+#define TCP_LISTEN_HASH_SIZE 64 /* listeners are few; this one stays put */
 #define TCP_SOURCE_PORT_MIN 49152
 #define TCP_SOURCE_PORT_MAX 65535
 
@@ -42,6 +94,15 @@
 #define TCP_FLG_IS(x, y) ((x & 0x3f) == (y))
 #define TCP_FLG_ISSET(x, y) ((x & 0x3f) & (y))
 
+#define TCP_SEQ_LT(a, b)  ((int32_t)((a) - (b)) < 0)
+#define TCP_SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+
+/*
+ * The key state is shared by every connection and advanced by each
+ * encdec; connections run in parallel under their own locks, so it
+ * has a lock of its own.
+ */
+static struct spinlock keylock;
 static uint32_t private_key = 0;
 static uint32_t shared_key = 0;
 
@@ -55,15 +116,33 @@ struct tcp_hdr {
     uint16_t win;
     uint16_t sum;
     uint16_t urg;
-    uint8_t opt;
-    uint8_t size;
-    uint8_t tep;
+};
+
+struct tcp_sack_block {
+    uint32_t start;
+    uint32_t end;
+};
+
+/* options carried by one received segment */
+struct tcp_opts {
+    uint8_t eno;
+    uint8_t flags; /* TCP_OPT_F_* present */
+    uint8_t wscale;
+    uint16_t mss;  /* 0 if absent */
+    uint32_t tsval;
+    uint32_t tsecr;
+    int nsacks;
+    struct tcp_sack_block sacks[TCP_SACK_BLOCKS_MAX];
 };
 
 struct tcp_txq_entry {
-    struct tcp_hdr *segment;
+    uint32_t seq;
+    uint8_t flg;
+    struct pbuf *payload; /* shared with the transmitted segment */
     uint16_t len;
-    //struct timeval timestamp;
+    uint32_t sent;   /* ticks at first transmission */
+    uint8_t retries; /* times retransmitted; RTT is only sampled at 0 */
+    uint8_t sacked;  /* the peer holds it; not resent in recovery */
     struct tcp_txq_entry *next;
 };
 
@@ -72,8 +151,26 @@ struct tcp_txq_head {
     struct tcp_txq_entry *tail;
 };
 
+/* Circular byte buffer; size is a power of 2, head and len wrap. */
+struct tcp_buf {
+    uint8_t *buf;
+    uint32_t size;
+    uint32_t head; /* offset of the next byte to read */
+    uint32_t len;  /* bytes waiting to be read */
+};
+
+/*
+ * Locking: cb->lock protects the connection state, queues and buffers.
+ * tcplock protects the hash tables, descriptors, ref, dead, parent and
+ * listener backlogs. A cb lock may be held while taking tcplock, and a
+ * listener's lock while taking one of its children's, never the reverse.
+ */
 struct tcp_cb {
-    uint8_t used;
+    struct spinlock lock;
+    int ref;  /* one for the tables, plus one per user of a looked-up cb */
+    int dead; /* cleared; no longer reachable through the tables */
+    int desc; /* socket descriptor, -1 until accepted */
+    int orphan; /* closed by the user; finishing the FIN exchange alone */
     uint8_t state;
     struct netif *iface;
     uint16_t port;
@@ -87,31 +184,162 @@ struct tcp_cb {
         uint16_t up;
         uint32_t wl1;
         uint32_t wl2;
-        uint16_t wnd;
+        uint32_t wnd;
+        uint8_t wscale;
     } snd;
     uint32_t iss;
     struct {
         uint32_t nxt;
         uint16_t up;
-        uint16_t wnd;
+        uint32_t wnd;
+        uint8_t wscale;
+        uint32_t adv; /* window in the last ACK sent, from last_ack_sent */
     } rcv;
     uint32_t irs;
     struct tcp_txq_head txq;
-    uint8_t window[4096];
+    struct tcp_buf rcvbuf; /* buf allocated once connected */
+    struct tcp_buf sndbuf; /* unsent data; sent segments live on txq */
+    uint16_t mss; /* payload per segment, less the options on every segment */
+    uint8_t nodelay; /* TCP_NODELAY: no Nagle */
+    uint8_t cork;    /* TCP_CORK: only full segments */
+    uint8_t opt;  /* TCP_OPT_F_* */
+    uint32_t last_ack_sent;
+    struct {
+        uint32_t recent;     /* TSval to echo */
+        uint32_t recent_age; /* ticks when recent was taken */
+    } ts;
+    struct {
+        int n;
+        struct tcp_sack_block ranges[TCP_OOO_MAX]; /* sorted and disjoint, past rcv.nxt */
+    } ooo; /* data held in rcvbuf beyond len until the gap fills */
+    struct {
+        uint32_t high;     /* highest sequence the peer has SACKed */
+        uint32_t rtx_next; /* resent up to here in this recovery */
+        int nblocks;       /* out-of-order data held here, to report */
+        struct tcp_sack_block blocks[TCP_SACK_BLOCKS_MAX];
+    } sack;
+    struct {
+        uint32_t srtt;   /* smoothed RTT, ticks << 3 */
+        uint32_t rttvar; /* RTT variation, ticks << 2 */
+        uint32_t rto;    /* current timeout in ticks, including backoff */
+        struct timer timer; /* retransmission, FIN_WAIT2 */
+    } rtx;
+    struct {
+        uint8_t pending; /* segments received since the last ACK went out */
+        struct timer timer; /* sends the ACK anyway; armed while one is owed */
+    } delack;
+    struct {
+        uint8_t probes;     /* sent since the last ACK; sets the backoff */
+        struct timer timer; /* armed while the peer's window is closed */
+    } persist;
+    struct tcp_cong cc;
+    struct tcp_cong_ops *cc_ops;
+    uint8_t dupacks;
+    uint8_t in_recovery; /* fast recovery until recover is acked */
+    uint32_t recover;
     struct tcp_cb *parent;
     struct queue_head backlog;
+    int backlog_len; /* established, waiting in backlog for accept */
+    int backlog_max; /* listen() backlog; also caps syn_len */
+    int syn_len;     /* tcp_reqs in SYN_RCVD */
+    uint8_t syncookies;      /* has answered a SYN with a cookie */
+    uint32_t syncookie_sent; /* ticks when it last did */
+    uint8_t hashed; /* TCP_HASHED_* */
+    struct tcp_cb *hash_next; /* connection or listener chain */
+    struct tcp_cb *bind_next; /* chain of cbs holding a local port */
+    struct tcp_cb *reap_next; /* children being dropped by a closing listener */
+};
+
+#define TCP_HASHED_NONE   0
+#define TCP_HASHED_CONN   1
+#define TCP_HASHED_LISTEN 2
+
+#define TCP_CB_LISTENER_SIZE 128 /* largest listen() backlog */
+
+/*
+ * What is left of a connection in TIME_WAIT: enough to acknowledge a
+ * retransmitted FIN and to keep old duplicates out of a new connection
+ * on the same ports for 2MSL, without a control block or buffers.
+ */
+struct tcp_tw {
+    struct tcp_tw *next;
+    struct netif *iface;
+    uint16_t port;
+    struct {
+        ip_addr_t addr;
+        uint16_t port;
+    } peer;
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    uint16_t win;      /* as last advertised */
+    uint8_t ts;        /* timestamps were in use */
+    uint32_t ts_recent;
+    uint32_t expire;    /* end of 2MSL; the timer catches up when it fires */
+    uint8_t dead;       /* dropped while its timer was firing */
+    struct timer timer;
 };
 
-#define TCP_CB_LISTENER_SIZE 128
+#define TCP_TW_DROP  0
+#define TCP_TW_ACK   1
+#define TCP_TW_REUSE 2
+
+/*
+ * A passive open between the SYN and the final ACK of the handshake.
+ * It keeps only what the SYN-ACK and the control block made from it
+ * need, so a burst of SYNs costs no buffers.
+ */
+struct tcp_req {
+    struct tcp_req *next;
+    struct tcp_cb *listener;
+    struct netif *iface;
+    uint16_t port;
+    struct {
+        ip_addr_t addr;
+        uint16_t port;
+    } peer;
+    uint32_t iss;
+    uint32_t irs;
+    uint16_t snd_wnd;    /* from the SYN, unscaled */
+    uint16_t rcv_wnd;    /* advertised in the SYN-ACK */
+    uint8_t rcv_wscale;
+    uint8_t opt;         /* TCP_OPT_F_* offered by both sides */
+    struct tcp_opts syn; /* mss, wscale and tsval of the SYN */
+    uint8_t retries;
+    uint8_t dead;        /* dropped while its timer was firing */
+    struct timer timer;  /* SYN-ACK retransmission */
+};
 
 #define TCP_CB_STATE_RX_ISREADY(x) (x->state == TCP_CB_STATE_ESTABLISHED || x->state == TCP_CB_STATE_FIN_WAIT1 || x->state == TCP_CB_STATE_FIN_WAIT2)
 #define TCP_CB_STATE_TX_ISREADY(x) (x->state == TCP_CB_STATE_ESTABLISHED || x->state == TCP_CB_STATE_CLOSE_WAIT)
 
-#define TCP_SOCKET_ISINVALID(x) (x < 0 || x >= TCP_CB_TABLE_SIZE)
-
-//static pthread_t timer_thread;
 static struct spinlock tcplock;
-struct tcp_cb cb_table[TCP_CB_TABLE_SIZE];
+static struct kmem_cache *tcp_cb_cache;
+static struct kmem_cache *tcp_req_cache;
+static struct kmem_cache *tcp_tw_cache;
+static struct desc_table tcp_descs; /* socket descriptor -> cb */
+
+/*
+ * Connections are found by (local port, peer addr, peer port) and
+ * listeners by local port; the local address is compared on lookup.
+ * Every cb with a local port is also on the bind hash, so checking
+ * whether a port is free costs one chain walk.
+ *
+ * The conn, bind, syn and timewait tables share one block of
+ * tcp_hash_size buckets each, which tcp_hash_grow doubles whenever
+ * connections and timewait buckets outnumber it, keeping chains about
+ * one entry long. They start out in tcp_hash_boot.
+ */
+static void *tcp_hash_boot[4 * TCP_HASH_MIN];
+static uint32_t tcp_hash_size;
+static struct tcp_cb **conn_hash;
+static struct tcp_cb *listen_hash[TCP_LISTEN_HASH_SIZE];
+static struct tcp_cb **bind_hash;
+static struct tcp_req **syn_hash; /* by the same key as conn_hash */
+static struct tcp_tw **tw_hash;   /* likewise */
+static int conn_count;
+static int tw_count;
+static uint16_t tcp_port_next;
+static uint32_t tcp_syncookie_secret;
 
 // Function to calculate modular exponentiation (base^exp % modulus)
 uint32_t mod_exp(uint32_t base, uint32_t exp, uint32_t modulus) {
@@ -129,11 +357,15 @@ uint32_t mod_exp(uint32_t base, uint32_t exp, uint32_t modulus) {
 
 // Function to generate initial public key
 uint32_t get_public_key() {
+    uint32_t public_key;
+
+    acquire(&keylock);
     // Generate a random private key
     private_key = (uint32_t)random() % (PRIME - 1) + 1; 
 
     // Calculate public key: public_key = GENERATOR^private_key % PRIME
-    uint32_t public_key = mod_exp(GENERATOR, private_key, PRIME);
+    public_key = mod_exp(GENERATOR, private_key, PRIME);
+    release(&keylock);
 
     return public_key;
 }
@@ -151,31 +383,527 @@ void encdec(uint8_t *buf, size_t len) {
     // Shared key from Diffie-Hellman key exchange
     size_t i;
     
+    acquire(&keylock);
     for (i = 0; i < len; ++i) {
         // Perform XOR operation with the next byte of the key
         buf[i] ^= (uint8_t)shared_key;
         // Update the key using a share pseudorandom number generator. 
-        shared_key = prng_helper(shared_key)
+        shared_key = prng_helper(shared_key);
+    }
+    release(&keylock);
+}
+
+static uint32_t
+tcp_hashfn (uint16_t port, ip_addr_t peer, uint16_t peer_port) {
+    uint32_t h;
+
+    h = peer ^ ((uint32_t)port << 16 | peer_port);
+    h ^= h >> 16;
+    h ^= h >> 8;
+    return h & (tcp_hash_size - 1);
+}
+
+static uint32_t
+tcp_port_hashfn (uint16_t port) {
+    return (port ^ (port >> 8)) & (tcp_hash_size - 1);
+}
+
+static uint32_t
+tcp_listen_hashfn (uint16_t port) {
+    return tcp_port_hashfn(port) & (TCP_LISTEN_HASH_SIZE - 1);
+}
+
+/* Point the tables at mem, which holds size buckets for each. */
+static void
+tcp_hash_set (void **mem, uint32_t size) {
+    tcp_hash_size = size;
+    conn_hash = (struct tcp_cb **)mem;
+    bind_hash = conn_hash + size;
+    syn_hash = (struct tcp_req **)(bind_hash + size);
+    tw_hash = (struct tcp_tw **)(syn_hash + size);
+}
+
+static void
+tcp_hash_free (void **mem, uint32_t size) {
+    if (mem == tcp_hash_boot) {
+        return;
+    }
+    if (4 * size * sizeof(void *) <= PGSIZE) {
+        kfree((char *)mem);
+    } else {
+        kfree_pages((char *)mem, kpage_order(4 * size * sizeof(void *)));
+    }
+}
+
+/*
+ * Double the tables once they hold more entries than buckets, moving
+ * every entry to its new chain. If memory is short the chains just get
+ * longer until a later try succeeds. Caller holds tcplock.
+ */
+static void
+tcp_hash_grow (void) {
+    struct tcp_cb **conn, **bind, *cb, *next;
+    struct tcp_req **syn, *req, *rnext;
+    struct tcp_tw **tw, *t, *tnext;
+    uint32_t size, old, i, h;
+    void **mem;
+
+    old = tcp_hash_size;
+    if (conn_count + tw_count <= old || old >= TCP_HASH_MAX) {
+        return;
+    }
+    size = old << 1;
+    if (4 * size * sizeof(void *) <= PGSIZE) {
+        mem = (void **)kalloc();
+    } else {
+        mem = (void **)kalloc_pages(kpage_order(4 * size * sizeof(void *)));
+    }
+    if (!mem) {
+        return;
+    }
+    memset(mem, 0, 4 * size * sizeof(void *));
+    conn = conn_hash;
+    bind = bind_hash;
+    syn = syn_hash;
+    tw = tw_hash;
+    tcp_hash_set(mem, size);
+    for (i = 0; i < old; i++) {
+        for (cb = conn[i]; cb; cb = next) {
+            next = cb->hash_next;
+            h = tcp_hashfn(cb->port, cb->peer.addr, cb->peer.port);
+            cb->hash_next = conn_hash[h];
+            conn_hash[h] = cb;
+        }
+        for (cb = bind[i]; cb; cb = next) {
+            next = cb->bind_next;
+            h = tcp_port_hashfn(cb->port);
+            cb->bind_next = bind_hash[h];
+            bind_hash[h] = cb;
+        }
+        for (req = syn[i]; req; req = rnext) {
+            rnext = req->next;
+            h = tcp_hashfn(req->port, req->peer.addr, req->peer.port);
+            req->next = syn_hash[h];
+            syn_hash[h] = req;
+        }
+        for (t = tw[i]; t; t = tnext) {
+            tnext = t->next;
+            h = tcp_hashfn(t->port, t->peer.addr, t->peer.port);
+            t->next = tw_hash[h];
+            tw_hash[h] = t;
+        }
     }
+    tcp_hash_free((void **)conn, old);
+}
+
+static void
+tcp_chain_remove (struct tcp_cb **head, struct tcp_cb *cb, int bind) {
+    struct tcp_cb **p;
 
+    for (p = head; *p; p = bind ? &(*p)->bind_next : &(*p)->hash_next) {
+        if (*p == cb) {
+            *p = bind ? cb->bind_next : cb->hash_next;
+            return;
+        }
+    }
 }
 
 static int
-tcp_txq_add (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
-    struct tcp_txq_entry *txq;
+tcp_port_inuse (uint16_t port) {
+    struct tcp_cb *cb;
 
-    txq = (struct tcp_txq_entry *)kalloc();
-    if (!txq) {
+    for (cb = bind_hash[tcp_port_hashfn(port)]; cb; cb = cb->bind_next) {
+        if (cb->port == port) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static struct tcp_tw *
+tcp_lookup_tw (struct netif *iface, uint16_t port, ip_addr_t peer, uint16_t peer_port) {
+    struct tcp_tw *tw;
+
+    for (tw = tw_hash[tcp_hashfn(port, peer, peer_port)]; tw; tw = tw->next) {
+        if (tw->port == port && tw->peer.addr == peer && tw->peer.port == peer_port && tw->iface == iface) {
+            return tw;
+        }
+    }
+    return NULL;
+}
+
+static void
+tcp_tw_unhash (struct tcp_tw *tw) {
+    struct tcp_tw **p;
+
+    p = &tw_hash[tcp_hashfn(tw->port, tw->peer.addr, tw->peer.port)];
+    for (; *p; p = &(*p)->next) {
+        if (*p == tw) {
+            *p = tw->next;
+            break;
+        }
+    }
+    tw_count--;
+}
+
+/* End TIME_WAIT early. Caller holds tcplock. */
+static void
+tcp_tw_drop (struct tcp_tw *tw) {
+    tcp_tw_unhash(tw);
+    if (timer_cancel(&tw->timer)) {
+        kmem_cache_free(tcp_tw_cache, tw);
+    } else {
+        tw->dead = 1; /* tcp_tw_timeout frees it */
+    }
+}
+
+/*
+ * May a new connection use these ports while an old one is in TIME_WAIT?
+ * Only if timestamps were on, so PAWS keeps its duplicates out; the
+ * TIME_WAIT entry is then dropped. Caller holds tcplock.
+ */
+static int
+tcp_tw_busy (struct netif *iface, uint16_t port, ip_addr_t peer, uint16_t peer_port) {
+    struct tcp_tw *tw;
+
+    tw = tcp_lookup_tw(iface, port, peer, peer_port);
+    if (!tw) {
+        return 0;
+    }
+    if (!tw->ts) {
+        return 1;
+    }
+    tcp_tw_drop(tw);
+    return 0;
+}
+
+/* Give cb a local port and put it on the bind hash. */
+static void
+tcp_bind_port (struct tcp_cb *cb, uint16_t port) {
+    struct tcp_cb **head;
+
+    cb->port = port;
+    head = &bind_hash[tcp_port_hashfn(port)];
+    cb->bind_next = *head;
+    *head = cb;
+}
+
+static int
+tcp_bind_ephemeral (struct tcp_cb *cb) {
+    uint32_t n, range = TCP_SOURCE_PORT_MAX - TCP_SOURCE_PORT_MIN + 1;
+    uint16_t port;
+
+    if (!tcp_port_next) {
+        tcp_port_next = TCP_SOURCE_PORT_MIN + time(NULL) % 1024;
+    }
+    for (n = 0; n < range; n++) {
+        port = hton16(tcp_port_next);
+        tcp_port_next = tcp_port_next == TCP_SOURCE_PORT_MAX ? TCP_SOURCE_PORT_MIN : tcp_port_next + 1;
+        if (!tcp_port_inuse(port) && !tcp_tw_busy(cb->iface, port, cb->peer.addr, cb->peer.port)) {
+            tcp_bind_port(cb, port);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void
+tcp_hash_conn (struct tcp_cb *cb) {
+    struct tcp_cb **head;
+
+    head = &conn_hash[tcp_hashfn(cb->port, cb->peer.addr, cb->peer.port)];
+    cb->hash_next = *head;
+    *head = cb;
+    cb->hashed = TCP_HASHED_CONN;
+    conn_count++;
+    tcp_hash_grow();
+}
+
+static void
+tcp_unhash_conn (struct tcp_cb *cb) {
+    tcp_chain_remove(&conn_hash[tcp_hashfn(cb->port, cb->peer.addr, cb->peer.port)], cb, 0);
+    cb->hashed = TCP_HASHED_NONE;
+    conn_count--;
+}
+
+static void
+tcp_hash_listen (struct tcp_cb *cb) {
+    struct tcp_cb **head;
+
+    head = &listen_hash[tcp_listen_hashfn(cb->port)];
+    cb->hash_next = *head;
+    *head = cb;
+    cb->hashed = TCP_HASHED_LISTEN;
+}
+
+static void
+tcp_unhash (struct tcp_cb *cb) {
+    switch (cb->hashed) {
+    case TCP_HASHED_CONN:
+        tcp_unhash_conn(cb);
+        break;
+    case TCP_HASHED_LISTEN:
+        tcp_chain_remove(&listen_hash[tcp_listen_hashfn(cb->port)], cb, 0);
+        break;
+    }
+    cb->hashed = TCP_HASHED_NONE;
+    if (cb->port) {
+        tcp_chain_remove(&bind_hash[tcp_port_hashfn(cb->port)], cb, 1);
+    }
+}
+
+static struct tcp_cb *
+tcp_lookup_conn (struct netif *iface, uint16_t port, ip_addr_t peer, uint16_t peer_port) {
+    struct tcp_cb *cb;
+
+    for (cb = conn_hash[tcp_hashfn(port, peer, peer_port)]; cb; cb = cb->hash_next) {
+        if (cb->port == port && cb->peer.addr == peer && cb->peer.port == peer_port &&
+            (!cb->iface || cb->iface == iface)) {
+            return cb;
+        }
+    }
+    return NULL;
+}
+
+static struct tcp_cb *
+tcp_lookup_listener (struct netif *iface, uint16_t port) {
+    struct tcp_cb *cb;
+
+    for (cb = listen_hash[tcp_listen_hashfn(port)]; cb; cb = cb->hash_next) {
+        if (cb->port == port && (!cb->iface || cb->iface == iface)) {
+            return cb;
+        }
+    }
+    return NULL;
+}
+
+static struct tcp_req *
+tcp_lookup_req (struct netif *iface, uint16_t port, ip_addr_t peer, uint16_t peer_port) {
+    struct tcp_req *req;
+
+    for (req = syn_hash[tcp_hashfn(port, peer, peer_port)]; req; req = req->next) {
+        if (req->port == port && req->peer.addr == peer && req->peer.port == peer_port && req->iface == iface) {
+            return req;
+        }
+    }
+    return NULL;
+}
+
+static void
+tcp_req_unhash (struct tcp_req *req) {
+    struct tcp_req **p;
+
+    p = &syn_hash[tcp_hashfn(req->port, req->peer.addr, req->peer.port)];
+    for (; *p; p = &(*p)->next) {
+        if (*p == req) {
+            *p = req->next;
+            break;
+        }
+    }
+    req->listener->syn_len--;
+}
+
+/* Forget a pending handshake. Caller holds tcplock. */
+static void
+tcp_req_drop (struct tcp_req *req) {
+    tcp_req_unhash(req);
+    if (timer_cancel(&req->timer)) {
+        kmem_cache_free(tcp_req_cache, req);
+    } else {
+        req->dead = 1; /* tcp_req_timeout frees it */
+    }
+}
+
+/* Drop every pending handshake of a closing listener. Caller holds tcplock. */
+static void
+tcp_req_flush (struct tcp_cb *lcb) {
+    struct tcp_req *req, *next;
+    int i;
+
+    for (i = 0; i < tcp_hash_size && lcb->syn_len; i++) {
+        for (req = syn_hash[i]; req; req = next) {
+            next = req->next;
+            if (req->listener == lcb) {
+                tcp_req_drop(req);
+            }
+        }
+    }
+}
+
+static int
+tcp_buf_alloc (struct tcp_buf *rb) {
+    if (rb->size <= PGSIZE) {
+        rb->buf = (uint8_t *)kalloc();
+    } else {
+        rb->buf = (uint8_t *)kalloc_pages(kpage_order(rb->size));
+    }
+    if (!rb->buf) {
+        return -1;
+    }
+    rb->head = rb->len = 0;
+    return 0;
+}
+
+static void
+tcp_buf_free (struct tcp_buf *rb) {
+    if (!rb->buf) {
+        return;
+    }
+    if (rb->size <= PGSIZE) {
+        kfree((char *)rb->buf);
+    } else {
+        kfree_pages((char *)rb->buf, kpage_order(rb->size));
+    }
+    rb->buf = NULL;
+}
+
+/* Store data off bytes past the end without making it readable. */
+static void
+tcp_buf_write_at (struct tcp_buf *rb, uint32_t off, uint8_t *data, size_t len) {
+    uint32_t tail, n;
+
+    tail = (rb->head + rb->len + off) & (rb->size - 1);
+    n = MIN(len, rb->size - tail);
+    memcpy(rb->buf + tail, data, n);
+    memcpy(rb->buf, data + n, len - n);
+}
+
+/* Append as much of data as fits; returns the number of bytes stored. */
+static size_t
+tcp_buf_write (struct tcp_buf *rb, uint8_t *data, size_t len) {
+    len = MIN(len, rb->size - rb->len);
+    tcp_buf_write_at(rb, 0, data, len);
+    rb->len += len;
+    return len;
+}
+
+/* Copy out and consume up to len bytes; returns the number copied. */
+static size_t
+tcp_buf_read (struct tcp_buf *rb, uint8_t *buf, size_t len) {
+    uint32_t n;
+
+    len = MIN(len, rb->len);
+    n = MIN(len, rb->size - rb->head);
+    memcpy(buf, rb->buf + rb->head, n);
+    memcpy(buf + n, rb->buf, len - n);
+    rb->head = (rb->head + len) & (rb->size - 1);
+    rb->len -= len;
+    return len;
+}
+
+/* Initial window per RFC 6928; slow start until the first loss. */
+static void
+tcp_cong_reset (struct tcp_cb *cb) {
+    cb->cc.mss = cb->mss;
+    cb->cc.cwnd = MIN(10 * cb->mss, MAX(2 * cb->mss, 14600));
+    cb->cc.ssthresh = (uint32_t)-1;
+    cb->cc_ops->init(&cb->cc);
+}
+
+/* The MSS we announce: what fits in one frame without options. */
+static uint16_t
+tcp_local_mss (struct netif *iface) {
+    return iface->dev->mtu - IP_HDR_SIZE_MIN - sizeof(struct tcp_hdr);
+}
+
+/* Smallest shift that lets the whole receive buffer be advertised. */
+static uint8_t
+tcp_rcv_wscale (uint32_t size) {
+    uint8_t shift = 0;
+
+    while ((size >> shift) > 0xffff && shift < TCP_WSCALE_MAX) {
+        shift++;
+    }
+    return shift;
+}
+
+/* Set up the buffers and segment size of a connection about to open. */
+static int
+tcp_cb_conn_init (struct tcp_cb *cb, struct netif *iface) {
+    if (tcp_buf_alloc(&cb->rcvbuf) == -1) {
+        return -1;
+    }
+    if (!cb->sndbuf.buf && tcp_buf_alloc(&cb->sndbuf) == -1) {
+        tcp_buf_free(&cb->rcvbuf);
         return -1;
     }
-    txq->segment = (struct tcp_hdr *)kalloc();
-    if (!txq->segment) {
-        kfree((char*)txq);
+    cb->rcv.wnd = cb->rcvbuf.size;
+    cb->mss = tcp_local_mss(iface);
+    tcp_cong_reset(cb);
+    return 0;
+}
+
+static void tcp_rtx_timeout (void *arg);
+static void tcp_delack_timeout (void *arg);
+static void tcp_persist_timeout (void *arg);
+
+static struct tcp_cb *
+tcp_cb_alloc (void) {
+    struct tcp_cb *cb;
+
+    cb = (struct tcp_cb *)kmem_cache_alloc(tcp_cb_cache);
+    if (!cb) {
+        return NULL;
+    }
+    memset(cb, 0, sizeof(*cb));
+    initlock(&cb->lock, "tcpcb");
+    cb->ref = 1;
+    cb->desc = -1;
+    cb->rcvbuf.size = TCP_RCVBUF_DEFAULT;
+    cb->sndbuf.size = TCP_SNDBUF_DEFAULT;
+    cb->mss = TCP_MSS_DEFAULT;
+    cb->rtx.rto = TCP_RTO_INIT;
+    cb->cc_ops = tcp_cong_default();
+    timer_init(&cb->rtx.timer, tcp_rtx_timeout, cb);
+    timer_init(&cb->delack.timer, tcp_delack_timeout, cb);
+    timer_init(&cb->persist.timer, tcp_persist_timeout, cb);
+    return cb;
+}
+
+/* Look up a socket descriptor and take a reference on its cb. */
+static struct tcp_cb *
+tcp_cb_get (int soc) {
+    struct tcp_cb *cb;
+
+    acquire(&tcplock);
+    cb = desc_get(&tcp_descs, soc);
+    if (cb) {
+        cb->ref++;
+    }
+    release(&tcplock);
+    return cb;
+}
+
+static void
+tcp_cb_put (struct tcp_cb *cb) {
+    int ref;
+
+    acquire(&tcplock);
+    ref = --cb->ref;
+    release(&tcplock);
+    if (ref) {
+        return;
+    }
+    tcp_buf_free(&cb->rcvbuf);
+    tcp_buf_free(&cb->sndbuf);
+    kmem_cache_free(tcp_cb_cache, cb);
+}
+
+static int
+tcp_txq_add (struct tcp_cb *cb, uint32_t seq, uint8_t flg, struct pbuf *payload, size_t len) {
+    struct tcp_txq_entry *txq;
+
+    txq = (struct tcp_txq_entry *)kmalloc(sizeof(*txq));
+    if (!txq) {
         return -1;
     }
-    memcpy(txq->segment, hdr, len);
+    txq->seq = seq;
+    txq->flg = flg;
+    txq->payload = payload ? pbuf_ref(payload) : NULL;
     txq->len = len;
-    //gettimeofday(&txq->timestamp, NULL);
+    txq->sent = ticks;
+    txq->retries = 0;
+    txq->sacked = 0;
     txq->next = NULL;
 
     // set txq to next of tail entry
@@ -190,80 +918,1086 @@ tcp_txq_add (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
     return 0;
 }
 
-static int
-tcp_cb_clear (struct tcp_cb *cb) {
-    struct tcp_txq_entry *txq;
-    struct queue_entry *entry;
-    struct tcp_cb *backlog;
-
-    while (cb->txq.head) {
-        txq = cb->txq.head;
+/*
+ * Arm or stop one of cb's timers. An armed timer holds a reference on
+ * cb, which its callback puts. Caller holds cb->lock and a reference.
+ */
+static void
+tcp_timer_arm (struct tcp_cb *cb, struct timer *t, uint32_t timeout) {
+    if (!timer_arm(t, timeout)) {
+        acquire(&tcplock);
+        cb->ref++;
+        release(&tcplock);
+    }
+}
+
+static void
+tcp_timer_stop (struct tcp_cb *cb, struct timer *t) {
+    if (timer_cancel(t)) {
+        acquire(&tcplock);
+        cb->ref--;
+        release(&tcplock);
+    }
+}
+
+static void
+tcp_timer_set (struct tcp_cb *cb, uint32_t timeout) {
+    tcp_timer_arm(cb, &cb->rtx.timer, timeout);
+}
+
+/* Fold an RTT sample into SRTT/RTTVAR and recompute RTO (RFC 6298 2.2-2.3). */
+static void
+tcp_rtt_update (struct tcp_cb *cb, uint32_t rtt) {
+    int32_t delta;
+
+    if (!cb->rtx.srtt) {
+        cb->rtx.srtt = rtt << 3;
+        cb->rtx.rttvar = rtt << 1;
+    } else {
+        delta = rtt - (cb->rtx.srtt >> 3);
+        cb->rtx.srtt += delta;
+        if (delta < 0) {
+            delta = -delta;
+        }
+        cb->rtx.rttvar += delta - (cb->rtx.rttvar >> 2);
+    }
+    cb->rtx.rto = (cb->rtx.srtt >> 3) + MAX(1, cb->rtx.rttvar);
+    cb->rtx.rto = MIN(MAX(cb->rtx.rto, TCP_RTO_MIN), TCP_RTO_MAX);
+}
+
+/* Sequence number just past a queued segment. */
+static uint32_t
+tcp_txq_end (struct tcp_txq_entry *txq) {
+    uint32_t end;
+
+    end = txq->seq + txq->len;
+    if (TCP_FLG_ISSET(txq->flg, TCP_FLG_SYN)) {
+        end++;
+    }
+    if (TCP_FLG_ISSET(txq->flg, TCP_FLG_FIN)) {
+        end++;
+    }
+    return end;
+}
+
+/*
+ * Drop the segments ack covers from the retransmission queue, take an
+ * RTT sample, and restart or stop the timer (RFC 6298 5.2-5.3). The
+ * sample comes from the echoed timestamp tsecr if there is one, else
+ * from the newest segment never retransmitted (Karn).
+ */
+static void
+tcp_txq_ack (struct tcp_cb *cb, uint32_t ack, uint32_t tsecr) {
+    struct tcp_txq_entry *txq;
+    uint32_t sent = 0;
+    int acked = 0, sample = 0;
+
+    while ((txq = cb->txq.head) != NULL) {
+        if (TCP_SEQ_LT(ack, tcp_txq_end(txq))) {
+            break;
+        }
         cb->txq.head = txq->next;
-        kfree((char*)txq->segment);
-        kfree((char*)txq);
+        acked = 1;
+        sample = !txq->retries;
+        sent = txq->sent;
+        if (txq->payload) {
+            pbuf_free(txq->payload);
+        }
+        kmfree(txq);
+    }
+    if (!acked) {
+        return;
+    }
+    if (tsecr && TCP_SEQ_LEQ(tsecr, ticks)) {
+        tcp_rtt_update(cb, ticks - tsecr);
+    } else if (sample) {
+        tcp_rtt_update(cb, ticks - sent);
     }
-    while (1) {
-        entry = queue_pop(&cb->backlog);
-        if (!entry) {
+    if (cb->txq.head) {
+        tcp_timer_set(cb, cb->rtx.rto);
+    } else {
+        cb->txq.tail = NULL;
+        tcp_timer_stop(cb, &cb->rtx.timer);
+    }
+}
+
+/* Stop the timers and drop everything waiting for an ACK. */
+static void
+tcp_txq_flush (struct tcp_cb *cb) {
+    struct tcp_txq_entry *txq;
+
+    tcp_timer_stop(cb, &cb->rtx.timer);
+    tcp_timer_stop(cb, &cb->delack.timer);
+    tcp_timer_stop(cb, &cb->persist.timer);
+    while (cb->txq.head) {
+        txq = cb->txq.head;
+        cb->txq.head = txq->next;
+        if (txq->payload) {
+            pbuf_free(txq->payload);
+        }
+        kmfree(txq);
+    }
+    cb->txq.tail = NULL;
+}
+
+/*
+ * Take cb out of the tables and drop what it holds; the memory goes
+ * when the last reference is put. Caller holds cb->lock and a reference.
+ */
+static void
+tcp_cb_clear (struct tcp_cb *cb) {
+    struct queue_entry *entry;
+    struct tcp_cb *children = NULL, *child;
+    int i;
+
+    tcp_txq_flush(cb);
+    acquire(&tcplock);
+    if (cb->state == TCP_CB_STATE_LISTEN) {
+        /* collect connections spawned here that nobody has accepted */
+        for (i = 0; i < tcp_hash_size; i++) {
+            for (child = conn_hash[i]; child; child = child->hash_next) {
+                if (child->parent == cb) {
+                    child->parent = NULL;
+                    child->ref++;
+                    child->reap_next = children;
+                    children = child;
+                }
+            }
+        }
+        while ((entry = queue_pop(&cb->backlog)) != NULL) {
+            kmfree(entry);
+        }
+        cb->backlog_len = 0;
+        tcp_req_flush(cb);
+    }
+    cb->state = TCP_CB_STATE_CLOSED;
+    cb->dead = 1;
+    tcp_unhash(cb);
+    if (cb->desc != -1) {
+        desc_free(&tcp_descs, cb->desc);
+        cb->desc = -1;
+    }
+    cb->ref--; /* the tables' reference; the caller still holds one */
+    wakeup(&cb->backlog);
+    release(&tcplock);
+    wakeup(cb);
+    while ((child = children) != NULL) {
+        children = child->reap_next;
+        acquire(&child->lock);
+        if (!child->dead) {
+            tcp_cb_clear(child);
+        }
+        release(&child->lock);
+        tcp_cb_put(child);
+    }
+}
+
+/* A passively opened connection is ready; hand it to accept. */
+static void
+tcp_cb_enqueue_accept (struct tcp_cb *cb) {
+    acquire(&tcplock);
+    if (cb->parent) {
+        cb->parent->backlog_len++;
+        queue_push(&cb->parent->backlog, cb, sizeof(*cb));
+        wakeup(&cb->parent->backlog);
+    }
+    release(&tcplock);
+}
+
+static uint8_t *
+tcp_opt_put32 (uint8_t *p, uint32_t v) {
+    v = hton32(v);
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static uint32_t
+tcp_opt_get32 (uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return ntoh32(v);
+}
+
+/*
+ * Options offered on a SYN or SYN-ACK: TCP-ENO first, where peers look
+ * for it, then MSS and whichever of flags (TCP_OPT_F_*) are offered.
+ */
+static size_t
+tcp_opt_syn (uint8_t *opt, struct netif *iface, uint8_t flags, uint8_t wscale, uint32_t tsecr) {
+    uint8_t *p = opt;
+    uint16_t mss;
+
+    *p++ = TCP_OPT_ENO;
+    *p++ = 3;
+    *p++ = 0x99;
+    *p++ = TCP_OPT_NOP;
+    mss = hton16(tcp_local_mss(iface));
+    *p++ = TCP_OPT_MSS;
+    *p++ = 4;
+    memcpy(p, &mss, sizeof(mss));
+    p += sizeof(mss);
+    if (flags & TCP_OPT_F_TS) {
+        if (flags & TCP_OPT_F_SACK) {
+            *p++ = TCP_OPT_SACK_PERM;
+            *p++ = 2;
+        } else {
+            *p++ = TCP_OPT_NOP;
+            *p++ = TCP_OPT_NOP;
+        }
+        *p++ = TCP_OPT_TS;
+        *p++ = 10;
+        p = tcp_opt_put32(p, ticks);
+        p = tcp_opt_put32(p, tsecr);
+    } else if (flags & TCP_OPT_F_SACK) {
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_SACK_PERM;
+        *p++ = 2;
+    }
+    if (flags & TCP_OPT_F_WS) {
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_WS;
+        *p++ = 3;
+        *p++ = wscale;
+    }
+    return p - opt;
+}
+
+/*
+ * Write the options for an outgoing segment into opt and return their
+ * length, a multiple of 4. A SYN offers everything in cb->opt; later
+ * segments carry a timestamp and, on pure ACKs, SACK blocks.
+ */
+static size_t
+tcp_opt_build (struct tcp_cb *cb, uint8_t flg, size_t len, uint8_t *opt) {
+    uint8_t *p = opt;
+    int i, n;
+
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        return tcp_opt_syn(opt, cb->iface, cb->opt, cb->rcv.wscale, cb->ts.recent);
+    }
+    if (cb->opt & TCP_OPT_F_TS) {
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_TS;
+        *p++ = 10;
+        p = tcp_opt_put32(p, ticks);
+        p = tcp_opt_put32(p, cb->ts.recent);
+    }
+    if ((cb->opt & TCP_OPT_F_SACK) && cb->sack.nblocks && !len) {
+        /* data segments are sized for the timestamp alone */
+        n = MIN(cb->sack.nblocks, (TCP_OPT_LEN_MAX - (p - opt) - 4) / 8);
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_SACK;
+        *p++ = 2 + 8 * n;
+        for (i = 0; i < n; i++) {
+            p = tcp_opt_put32(p, cb->sack.blocks[i].start);
+            p = tcp_opt_put32(p, cb->sack.blocks[i].end);
+        }
+    }
+    return p - opt;
+}
+
+/* Pick out the options we understand; malformed ones end the walk. */
+static void
+tcp_opt_parse (struct tcp_hdr *hdr, size_t hlen, struct tcp_opts *opts) {
+    uint8_t *p, *end;
+    uint8_t kind, len;
+    int i;
+
+    memset(opts, 0, sizeof(*opts));
+    p = (uint8_t *)(hdr + 1);
+    end = (uint8_t *)hdr + hlen;
+    while (p < end) {
+        kind = *p;
+        if (kind == TCP_OPT_EOL) {
+            break;
+        }
+        if (kind == TCP_OPT_NOP) {
+            p++;
+            continue;
+        }
+        if (end - p < 2 || (len = p[1]) < 2 || len > end - p) {
+            break;
+        }
+        switch (kind) {
+        case TCP_OPT_MSS:
+            if (len == 4) {
+                opts->mss = (p[2] << 8) | p[3];
+            }
+            break;
+        case TCP_OPT_WS:
+            if (len == 3) {
+                opts->flags |= TCP_OPT_F_WS;
+                opts->wscale = MIN(p[2], TCP_WSCALE_MAX);
+            }
+            break;
+        case TCP_OPT_SACK_PERM:
+            if (len == 2) {
+                opts->flags |= TCP_OPT_F_SACK;
+            }
             break;
+        case TCP_OPT_SACK:
+            if ((len - 2) % 8 == 0) {
+                opts->nsacks = MIN((len - 2) / 8, TCP_SACK_BLOCKS_MAX);
+                for (i = 0; i < opts->nsacks; i++) {
+                    opts->sacks[i].start = tcp_opt_get32(p + 2 + 8 * i);
+                    opts->sacks[i].end = tcp_opt_get32(p + 6 + 8 * i);
+                }
+            }
+            break;
+        case TCP_OPT_TS:
+            if (len == 10) {
+                opts->flags |= TCP_OPT_F_TS;
+                opts->tsval = tcp_opt_get32(p + 2);
+                opts->tsecr = tcp_opt_get32(p + 6);
+            }
+            break;
+        case TCP_OPT_ENO:
+            opts->eno = 1;
+            break;
+        }
+        p += len;
+    }
+}
+
+/*
+ * Settle the options of a connection from the peer's SYN: keep what
+ * both sides offered, and size segments for the agreed MSS less the
+ * timestamp every segment will carry (RFC 7323, RFC 2018, RFC 6691).
+ */
+static void
+tcp_opt_negotiate (struct tcp_cb *cb, struct tcp_opts *opts) {
+    uint16_t mss;
+
+    cb->opt &= opts->flags;
+    if (cb->opt & TCP_OPT_F_WS) {
+        cb->snd.wscale = opts->wscale;
+        cb->rcv.wscale = tcp_rcv_wscale(cb->rcvbuf.size);
+    } else {
+        cb->snd.wscale = cb->rcv.wscale = 0;
+    }
+    if (cb->opt & TCP_OPT_F_TS) {
+        cb->ts.recent = opts->tsval;
+        cb->ts.recent_age = ticks;
+    }
+    mss = MIN(tcp_local_mss(cb->iface), opts->mss ? MAX(opts->mss, TCP_MSS_MIN) : TCP_MSS_DEFAULT);
+    if (cb->opt & TCP_OPT_F_TS) {
+        mss -= TCP_OPT_LEN_TS;
+    }
+    cb->mss = mss;
+    tcp_cong_reset(cb);
+}
+
+/* The window a segment advertises; it is only scaled outside the SYN. */
+static uint32_t
+tcp_seg_wnd (struct tcp_cb *cb, struct tcp_hdr *hdr) {
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
+        return ntoh16(hdr->win);
+    }
+    return (uint32_t)ntoh16(hdr->win) << cb->snd.wscale;
+}
+
+/*
+ * Put tmpl and opt in front of payload and send it to peer. payload,
+ * if any, is consumed: the header goes in a separate pbuf that the
+ * lower layers prepend to, and the NIC gathers the two.
+ */
+static ssize_t
+tcp_segment_tx (struct netif *iface, ip_addr_t peer, struct tcp_hdr *tmpl, uint8_t *opt, size_t optlen, struct pbuf *payload, size_t len) {
+    struct pbuf *segment;
+    struct tcp_hdr *hdr;
+    ip_addr_t self;
+    uint32_t pseudo = 0;
+    size_t hlen;
+
+    segment = pbuf_alloc();
+    if (!segment) {
+        if (payload) {
+            pbuf_free(payload);
+        }
+        return -1;
+    }
+    hlen = sizeof(struct tcp_hdr) + optlen;
+    hdr = (struct tcp_hdr *)pbuf_push(segment, hlen);
+    memcpy(hdr, tmpl, sizeof(struct tcp_hdr));
+    memcpy(hdr + 1, opt, optlen);
+    segment->frag = payload;
+    hdr->off = (hlen >> 2) << 4;
+    hdr->sum = 0;
+
+    self = ((struct netif_ip *)iface)->unicast;
+    pseudo += (self >> 16) & 0xffff;
+    pseudo += self & 0xffff;
+    pseudo += (peer >> 16) & 0xffff;
+    pseudo += peer & 0xffff;
+    pseudo += hton16((uint16_t)IP_PROTOCOL_TCP);
+    pseudo += hton16(hlen + len);
+    hdr->sum = pbuf_cksum16(segment, pseudo);
+    hexdump(&peer, sizeof(ip_addr_t));
+    ip_tx(iface, IP_PROTOCOL_TCP, segment, &peer);
+    return len;
+}
+
+/*
+ * Send one segment of cb. payload, if any, is consumed; the segment and
+ * the retransmission queue share it.
+ */
+static ssize_t
+tcp_tx_segment (struct tcp_cb *cb, uint32_t seq, uint32_t ack, uint8_t flg, struct pbuf *payload, size_t len) {
+    struct tcp_hdr hdr;
+    uint8_t opt[TCP_OPT_LEN_MAX];
+    size_t optlen;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.src = cb->port;
+    hdr.dst = cb->peer.port;
+    hdr.seq = hton32(seq);
+    hdr.ack = hton32(ack);
+    hdr.flg = flg;
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        hdr.win = hton16(MIN(cb->rcv.wnd, 0xffff));
+    } else {
+        hdr.win = hton16(MIN(cb->rcv.wnd >> cb->rcv.wscale, 0xffff));
+    }
+    optlen = tcp_opt_build(cb, flg, len, opt);
+    if (TCP_FLG_ISSET(flg, TCP_FLG_ACK)) {
+        cb->last_ack_sent = ack;
+        cb->rcv.adv = TCP_FLG_ISSET(flg, TCP_FLG_SYN) ? ntoh16(hdr.win) : (uint32_t)ntoh16(hdr.win) << cb->rcv.wscale;
+        if (ack == cb->rcv.nxt) {
+            /* whatever this is, it carries the ACK we owed */
+            cb->delack.pending = 0;
+            tcp_timer_stop(cb, &cb->delack.timer);
+        }
+    }
+    return tcp_segment_tx(cb->iface, cb->peer.addr, &hdr, opt, optlen, payload, len);
+}
+
+/* Queue a new segment for retransmission if it uses sequence space. */
+static void
+tcp_tx_track (struct tcp_cb *cb, uint32_t seq, uint8_t flg, struct pbuf *payload, size_t len) {
+    if (!len && !TCP_FLG_ISSET(flg, TCP_FLG_SYN | TCP_FLG_FIN)) {
+        return;
+    }
+    if (tcp_txq_add(cb, seq, flg, payload, len) == -1) {
+        return;
+    }
+    if (!timer_pending(&cb->rtx.timer)) {
+        tcp_timer_set(cb, cb->rtx.rto);
+    }
+}
+
+static ssize_t
+tcp_tx (struct tcp_cb *cb, uint32_t seq, uint32_t ack, uint8_t flg, uint8_t *buf, size_t len) {
+    struct pbuf *payload = NULL;
+
+    if (len) {
+        payload = pbuf_alloc();
+        if (!payload) {
+            return -1;
+        }
+        payload->data = payload->buf; /* never prepended to */
+        if (pbuf_append(payload, buf, len) == -1) {
+            pbuf_free(payload);
+            return -1;
         }
-        backlog = entry->data;
-        kfree((char*)entry);
-        tcp_cb_clear(backlog);
     }
-    memset(cb, 0, sizeof(*cb));
-    return 0;
+    tcp_tx_track(cb, seq, flg, payload, len);
+    return tcp_tx_segment(cb, seq, ack, flg, payload, len);
+}
+
+/* Send len bytes from the head of the send buffer as a new segment. */
+static int
+tcp_output_segment (struct tcp_cb *cb, size_t len) {
+    struct pbuf *payload;
+    uint8_t *data, flg;
+
+    payload = pbuf_alloc();
+    if (!payload) {
+        return -1;
+    }
+    payload->data = payload->buf; /* never prepended to */
+    data = pbuf_put(payload, len);
+    if (!data) {
+        pbuf_free(payload);
+        return -1;
+    }
+    tcp_buf_read(&cb->sndbuf, data, len);
+    flg = TCP_FLG_ACK;
+    if (!cb->sndbuf.len) {
+        flg |= TCP_FLG_PSH;
+    }
+    tcp_tx_track(cb, cb->snd.nxt, flg, payload, len);
+    tcp_tx_segment(cb, cb->snd.nxt, cb->rcv.nxt, flg, payload, len);
+    cb->snd.nxt += len;
+    return 0;
+}
+
+/*
+ * May a segment shorter than the MSS go out now? Not while corked, and
+ * with Nagle (RFC 896, RFC 1122 4.2.3.4) not while data is unacknowledged.
+ */
+static int
+tcp_output_small_ok (struct tcp_cb *cb, uint32_t inflight) {
+    if (cb->cork) {
+        return 0;
+    }
+    return cb->nodelay || !inflight;
+}
+
+/* The wait before the next window probe, doubling with each unanswered one. */
+static uint32_t
+tcp_persist_len (struct tcp_cb *cb) {
+    return MIN(cb->rtx.rto << MIN(cb->persist.probes, 6), TCP_RTO_MAX);
+}
+
+/*
+ * Move data from the send buffer onto the wire, in segments of at most
+ * one MSS and within both the peer's window and the congestion window.
+ * Called after send() queues data and whenever an ACK arrives; with
+ * data waiting on a closed window it starts the persist timer.
+ */
+static void
+tcp_output (struct tcp_cb *cb) {
+    uint32_t inflight, wnd;
+    size_t len;
+
+    if (!TCP_CB_STATE_TX_ISREADY(cb)) {
+        return;
+    }
+    while (cb->sndbuf.len) {
+        inflight = cb->snd.nxt - cb->snd.una;
+        wnd = MIN(cb->snd.wnd, cb->cc.cwnd);
+        if (inflight >= wnd) {
+            break;
+        }
+        len = MIN(cb->sndbuf.len, MIN(cb->mss, wnd - inflight));
+        if (len < cb->mss && !tcp_output_small_ok(cb, inflight)) {
+            return; /* an ACK or uncorking sends it */
+        }
+        if (tcp_output_segment(cb, len) == -1) {
+            break;
+        }
+    }
+    if (cb->sndbuf.len && !cb->txq.head && !cb->snd.wnd) {
+        /* zero window and nothing in flight: probe until it opens */
+        if (!timer_pending(&cb->persist.timer)) {
+            tcp_timer_arm(cb, &cb->persist.timer, tcp_persist_len(cb));
+        }
+    } else {
+        cb->persist.probes = 0;
+        tcp_timer_stop(cb, &cb->persist.timer);
+    }
+}
+
+static void
+tcp_txq_resend (struct tcp_cb *cb, struct tcp_txq_entry *txq) {
+    txq->retries++;
+    if (txq->payload) {
+        pbuf_ref(txq->payload);
+    }
+    tcp_tx_segment(cb, txq->seq, cb->rcv.nxt, txq->flg, txq->payload, txq->len);
+    cb->sack.rtx_next = tcp_txq_end(txq);
+}
+
+/* Resend the oldest unacknowledged segment. */
+static void
+tcp_retransmit (struct tcp_cb *cb) {
+    if (cb->txq.head) {
+        tcp_txq_resend(cb, cb->txq.head);
+    }
+}
+
+/*
+ * Resend the next segment that looks lost during recovery: the oldest
+ * one if it has not gone out again yet, otherwise, with SACK, the
+ * first hole below the highest SACKed data (a simplified RFC 6675).
+ */
+static void
+tcp_recovery_retransmit (struct tcp_cb *cb) {
+    struct tcp_txq_entry *txq;
+
+    txq = cb->txq.head;
+    if (!txq) {
+        return;
+    }
+    if (TCP_SEQ_LEQ(cb->sack.rtx_next, txq->seq)) {
+        tcp_txq_resend(cb, txq);
+        return;
+    }
+    if (!(cb->opt & TCP_OPT_F_SACK)) {
+        return;
+    }
+    for (; txq && TCP_SEQ_LT(txq->seq, cb->sack.high); txq = txq->next) {
+        if (!txq->sacked && TCP_SEQ_LEQ(cb->sack.rtx_next, txq->seq)) {
+            tcp_txq_resend(cb, txq);
+            return;
+        }
+    }
+}
+
+/* Mark the queued segments that the peer's SACK blocks cover (RFC 2018). */
+static void
+tcp_sack_update (struct tcp_cb *cb, struct tcp_opts *opts) {
+    struct tcp_txq_entry *txq;
+    struct tcp_sack_block *b;
+    int i;
+
+    for (i = 0; i < opts->nsacks; i++) {
+        b = &opts->sacks[i];
+        if (!TCP_SEQ_LT(b->start, b->end) || TCP_SEQ_LT(b->start, cb->snd.una) || TCP_SEQ_LT(cb->snd.nxt, b->end)) {
+            continue;
+        }
+        for (txq = cb->txq.head; txq; txq = txq->next) {
+            if (TCP_SEQ_LEQ(b->start, txq->seq) && TCP_SEQ_LEQ(tcp_txq_end(txq), b->end)) {
+                txq->sacked = 1;
+            }
+        }
+        if (TCP_SEQ_LT(cb->sack.high, b->end)) {
+            cb->sack.high = b->end;
+        }
+    }
+}
+
+/*
+ * New data was acked. In fast recovery a partial ACK means the next
+ * hole is lost too (RFC 6582); otherwise the algorithm grows cwnd.
+ */
+static void
+tcp_cong_ack (struct tcp_cb *cb, uint32_t acked) {
+    cb->dupacks = 0;
+    if (!cb->in_recovery) {
+        cb->cc_ops->cong_avoid(&cb->cc, acked, cb->rtx.srtt >> 3);
+        return;
+    }
+    if (TCP_SEQ_LEQ(cb->recover, cb->snd.una)) {
+        cb->cc.cwnd = MIN(cb->cc.ssthresh, (cb->snd.nxt - cb->snd.una) + cb->mss);
+        cb->in_recovery = 0;
+        return;
+    }
+    tcp_recovery_retransmit(cb);
+    cb->cc.cwnd -= MIN(acked, cb->cc.cwnd);
+    if (acked >= cb->mss) {
+        cb->cc.cwnd += cb->mss;
+    }
+    cb->cc.cwnd = MAX(cb->cc.cwnd, cb->mss);
+}
+
+/* Fast retransmit on the third duplicate ACK, then inflate (RFC 5681 3.2). */
+static void
+tcp_cong_dupack (struct tcp_cb *cb) {
+    if (cb->in_recovery) {
+        cb->cc.cwnd += cb->mss;
+        tcp_recovery_retransmit(cb);
+        return;
+    }
+    if (++cb->dupacks < TCP_DUPACK_THRESH || !TCP_SEQ_LT(cb->recover, cb->snd.una)) {
+        return;
+    }
+    cb->cc.ssthresh = cb->cc_ops->ssthresh(&cb->cc, cb->snd.nxt - cb->snd.una);
+    cb->recover = cb->snd.nxt;
+    cb->in_recovery = 1;
+    tcp_retransmit(cb);
+    cb->cc.cwnd = cb->cc.ssthresh + TCP_DUPACK_THRESH * cb->mss;
+}
+
+/*
+ * A connect() that failed: stop the timers, drop the unanswered SYN
+ * and take cb off the connection hash, keeping its port, so that it
+ * is back where it was before connect() and may try again.
+ */
+static void
+tcp_connect_abort (struct tcp_cb *cb) {
+    tcp_txq_flush(cb);
+    acquire(&tcplock);
+    if (cb->hashed == TCP_HASHED_CONN) {
+        tcp_unhash_conn(cb);
+    }
+    release(&tcplock);
+    cb->state = TCP_CB_STATE_CLOSED;
+}
+
+/*
+ * The retransmission timer fired: resend the oldest unacknowledged
+ * segment and back off (RFC 6298 5.4-5.6), give up on a peer that has
+ * stopped answering, or end an orphaned FIN_WAIT2.
+ */
+static void
+tcp_timeout (struct tcp_cb *cb) {
+    struct tcp_txq_entry *txq;
+
+    txq = cb->txq.head;
+    if (!txq) {
+        if (cb->orphan && cb->state == TCP_CB_STATE_FIN_WAIT2) {
+            tcp_cb_clear(cb);
+            return;
+        }
+        return;
+    }
+    if (txq->retries == TCP_RETRIES_MAX) {
+        /* the peer is gone; let close() clean up, or do it here if it has */
+        cb->state = TCP_CB_STATE_CLOSED;
+        wakeup(cb);
+        if (cb->orphan) {
+            tcp_cb_clear(cb);
+        }
+        return;
+    }
+    if (!txq->retries) {
+        /* RFC 5681 3.1: a loss, once per segment however often it times out */
+        cb->cc.ssthresh = cb->cc_ops->ssthresh(&cb->cc, cb->snd.nxt - cb->snd.una);
+    }
+    cb->cc.cwnd = cb->mss;
+    cb->in_recovery = 0;
+    cb->dupacks = 0;
+    cb->recover = cb->snd.nxt;
+    /* the peer may renege on SACKed data; start over from una */
+    for (txq = cb->txq.head; txq; txq = txq->next) {
+        txq->sacked = 0;
+    }
+    cb->sack.high = cb->snd.una;
+    tcp_retransmit(cb);
+    cb->rtx.rto = MIN(cb->rtx.rto * 2, TCP_RTO_MAX);
+    tcp_timer_set(cb, cb->rtx.rto);
+}
+
+static void
+tcp_rtx_timeout (void *arg) {
+    struct tcp_cb *cb = arg;
+
+    acquire(&cb->lock);
+    /* re-armed since it fired: that run will do */
+    if (!cb->dead && !timer_pending(&cb->rtx.timer)) {
+        tcp_timeout(cb);
+    }
+    release(&cb->lock);
+    tcp_cb_put(cb);
+}
+
+/*
+ * Persist timer (RFC 1122 4.2.2.17): probe a closed window with a
+ * segment just below snd.una, which the peer must answer with an ACK
+ * carrying its current window. Probes hold no data, so they are
+ * neither retransmitted nor taken as loss. A peer that keeps
+ * answering keeps the connection open however long its window stays
+ * shut; one that stops answering TCP_RETRIES_MAX probes in a row is
+ * taken to be gone.
+ */
+static void
+tcp_persist_timeout (void *arg) {
+    struct tcp_cb *cb = arg;
+
+    acquire(&cb->lock);
+    if (cb->dead || timer_pending(&cb->persist.timer) || !TCP_CB_STATE_TX_ISREADY(cb) ||
+        !cb->sndbuf.len || cb->txq.head || cb->snd.wnd) {
+        goto out;
+    }
+    if (cb->persist.probes == TCP_RETRIES_MAX) {
+        cb->state = TCP_CB_STATE_CLOSED;
+        wakeup(cb);
+        if (cb->orphan) {
+            tcp_cb_clear(cb);
+        }
+        goto out;
+    }
+    tcp_tx_segment(cb, cb->snd.una - 1, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
+    cb->persist.probes++;
+    tcp_timer_arm(cb, &cb->persist.timer, tcp_persist_len(cb));
+out:
+    release(&cb->lock);
+    tcp_cb_put(cb);
+}
+
+/*
+ * Acknowledge in-order data (RFC 1122 4.2.3.2, RFC 5681 4.2): at once
+ * for every second segment or when asked to, otherwise after at most
+ * TCP_DELACK_TIMEOUT, unless data going the other way carries it first.
+ */
+static void
+tcp_delack (struct tcp_cb *cb, int now) {
+    if (now || ++cb->delack.pending >= TCP_DELACK_SEGS) {
+        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
+        return;
+    }
+    if (!timer_pending(&cb->delack.timer)) {
+        tcp_timer_arm(cb, &cb->delack.timer, TCP_DELACK_TIMEOUT);
+    }
+}
+
+static void
+tcp_delack_timeout (void *arg) {
+    struct tcp_cb *cb = arg;
+
+    acquire(&cb->lock);
+    /* re-armed since it fired: that run will do */
+    if (!cb->dead && !timer_pending(&cb->delack.timer) && cb->delack.pending) {
+        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
+    }
+    release(&cb->lock);
+    tcp_cb_put(cb);
+}
+
+/* RFC 793: take the send window from the newest segment only. */
+static void
+tcp_update_window (struct tcp_cb *cb, struct tcp_hdr *hdr) {
+    uint32_t seq, ack;
+
+    seq = ntoh32(hdr->seq);
+    ack = ntoh32(hdr->ack);
+    if (TCP_SEQ_LT(cb->snd.wl1, seq) || (cb->snd.wl1 == seq && TCP_SEQ_LEQ(cb->snd.wl2, ack))) {
+        cb->snd.wnd = tcp_seg_wnd(cb, hdr);
+        cb->snd.wl1 = seq;
+        cb->snd.wl2 = ack;
+    }
+}
+
+/*
+ * Report the held ranges as SACK blocks, the one holding the most
+ * recently received segment first (RFC 2018 4).
+ */
+static void
+tcp_sack_build (struct tcp_cb *cb, uint32_t recent) {
+    struct tcp_sack_block *r;
+    int i, n = 0;
+
+    for (i = 0; i < cb->ooo.n; i++) {
+        r = &cb->ooo.ranges[i];
+        if (TCP_SEQ_LEQ(r->start, recent) && TCP_SEQ_LT(recent, r->end)) {
+            cb->sack.blocks[n++] = *r;
+            break;
+        }
+    }
+    for (i = 0; i < cb->ooo.n && n < TCP_SACK_BLOCKS_MAX; i++) {
+        r = &cb->ooo.ranges[i];
+        if (n && r->start == cb->sack.blocks[0].start) {
+            continue;
+        }
+        cb->sack.blocks[n++] = *r;
+    }
+    cb->sack.nblocks = n;
+}
+
+/*
+ * Keep a segment that arrived ahead of rcv.nxt. The bytes go straight
+ * to their place in the receive buffer and only the range is recorded;
+ * what falls outside the window or finds the range table full is dropped.
+ */
+static void
+tcp_ooo_insert (struct tcp_cb *cb, uint32_t seq, uint8_t *data, size_t len) {
+    struct tcp_sack_block *r = cb->ooo.ranges;
+    uint32_t off, room, end;
+    int i, j;
+
+    off = seq - cb->rcv.nxt;
+    room = cb->rcvbuf.size - cb->rcvbuf.len;
+    if (off >= room) {
+        return;
+    }
+    len = MIN(len, room - off);
+    end = seq + len;
+    for (i = 0; i < cb->ooo.n && TCP_SEQ_LT(r[i].end, seq); i++);
+    if (i == cb->ooo.n || TCP_SEQ_LT(end, r[i].start)) {
+        if (cb->ooo.n == TCP_OOO_MAX) {
+            return;
+        }
+        memmove(&r[i + 1], &r[i], (cb->ooo.n - i) * sizeof(*r));
+        r[i].start = seq;
+        r[i].end = end;
+        cb->ooo.n++;
+    } else {
+        if (TCP_SEQ_LT(seq, r[i].start)) {
+            r[i].start = seq;
+        }
+        if (TCP_SEQ_LT(r[i].end, end)) {
+            r[i].end = end;
+        }
+        /* swallow the ranges that now touch it */
+        for (j = i + 1; j < cb->ooo.n && TCP_SEQ_LEQ(r[j].start, r[i].end); j++) {
+            if (TCP_SEQ_LT(r[i].end, r[j].end)) {
+                r[i].end = r[j].end;
+            }
+        }
+        memmove(&r[i + 1], &r[j], (cb->ooo.n - j) * sizeof(*r));
+        cb->ooo.n -= j - i - 1;
+    }
+    tcp_buf_write_at(&cb->rcvbuf, off, data, len);
+    tcp_sack_build(cb, seq);
+}
+
+/* rcv.nxt moved; make the held ranges it reached readable. */
+static void
+tcp_ooo_drain (struct tcp_cb *cb) {
+    struct tcp_sack_block *r = cb->ooo.ranges;
+    uint32_t recent;
+
+    if (!cb->ooo.n) {
+        return;
+    }
+    recent = cb->sack.nblocks ? cb->sack.blocks[0].start : cb->rcv.nxt;
+    while (cb->ooo.n && TCP_SEQ_LEQ(r[0].start, cb->rcv.nxt)) {
+        if (TCP_SEQ_LT(cb->rcv.nxt, r[0].end)) {
+            cb->rcvbuf.len += r[0].end - cb->rcv.nxt;
+            cb->rcv.nxt = r[0].end;
+        }
+        cb->ooo.n--;
+        memmove(&r[0], &r[1], cb->ooo.n * sizeof(*r));
+    }
+    tcp_sack_build(cb, recent);
+}
+
+/*
+ * A timewait bucket's deadline. A retransmitted FIN moves it on without
+ * touching the armed timer, which re-arms itself when it finds the
+ * deadline still ahead.
+ */
+static int
+tcp_timer_due (uint32_t expire) {
+    return expire && (int32_t)(ticks - expire) >= 0;
+}
+
+/* The tick timeout ticks from now; never 0, which means stopped. */
+static uint32_t
+tcp_deadline (uint32_t timeout) {
+    uint32_t t;
+
+    t = ticks + timeout;
+    return t ? t : 1;
+}
+
+/* 2MSL is up, unless a retransmitted FIN pushed it back. */
+static void
+tcp_tw_timeout (void *arg) {
+    struct tcp_tw *tw = arg;
+
+    acquire(&tcplock);
+    if (tw->dead) {
+        kmem_cache_free(tcp_tw_cache, tw);
+    } else if (!tcp_timer_due(tw->expire)) {
+        timer_arm(&tw->timer, tw->expire - ticks);
+    } else {
+        tcp_tw_unhash(tw);
+        kmem_cache_free(tcp_tw_cache, tw);
+    }
+    release(&tcplock);
+}
+
+/*
+ * Hand cb over to a timewait bucket and free it. Without a bucket, when
+ * memory or TCP_TIMEWAIT_MAX runs out, the connection just closes.
+ * Caller holds cb->lock and a reference.
+ */
+static void
+tcp_tw_enter (struct tcp_cb *cb) {
+    struct tcp_tw *tw;
+    int h;
+
+    tw = (struct tcp_tw *)kmem_cache_alloc(tcp_tw_cache);
+    if (tw) {
+        tw->iface = cb->iface;
+        tw->port = cb->port;
+        tw->peer.addr = cb->peer.addr;
+        tw->peer.port = cb->peer.port;
+        tw->snd_nxt = cb->snd.nxt;
+        tw->rcv_nxt = cb->rcv.nxt;
+        tw->win = MIN(cb->rcv.wnd >> cb->rcv.wscale, 0xffff);
+        tw->ts = (cb->opt & TCP_OPT_F_TS) ? 1 : 0;
+        tw->ts_recent = cb->ts.recent;
+        tw->expire = tcp_deadline(TCP_TIMEWAIT_LEN);
+        tw->dead = 0;
+        timer_init(&tw->timer, tcp_tw_timeout, tw);
+    }
+    acquire(&tcplock);
+    if (tw && tw_count < TCP_TIMEWAIT_MAX) {
+        h = tcp_hashfn(tw->port, tw->peer.addr, tw->peer.port);
+        tw->next = tw_hash[h];
+        tw_hash[h] = tw;
+        tw_count++;
+        tcp_hash_grow();
+        timer_arm(&tw->timer, TCP_TIMEWAIT_LEN);
+        tw = NULL;
+    }
+    release(&tcplock);
+    if (tw) {
+        kmem_cache_free(tcp_tw_cache, tw);
+    }
+    cb->state = TCP_CB_STATE_TIME_WAIT;
+    tcp_cb_clear(cb);
+}
+
+/* ACK from a timewait bucket; tw is a copy taken under tcplock. */
+static void
+tcp_tw_tx (struct tcp_tw *tw) {
+    struct tcp_hdr hdr;
+    uint8_t opt[TCP_OPT_LEN_TS], *p = opt;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.src = tw->port;
+    hdr.dst = tw->peer.port;
+    hdr.seq = hton32(tw->snd_nxt);
+    hdr.ack = hton32(tw->rcv_nxt);
+    hdr.flg = TCP_FLG_ACK;
+    hdr.win = hton16(tw->win);
+    if (tw->ts) {
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_NOP;
+        *p++ = TCP_OPT_TS;
+        *p++ = 10;
+        p = tcp_opt_put32(p, ticks);
+        p = tcp_opt_put32(p, tw->ts_recent);
+    }
+    tcp_segment_tx(tw->iface, tw->peer.addr, &hdr, opt, p - opt, NULL, 0);
 }
 
-static ssize_t
-tcp_tx (struct tcp_cb *cb, uint32_t seq, uint32_t ack, uint8_t flg, uint8_t *buf, size_t len) {
-    uint8_t segment[1500];
-    struct tcp_hdr *hdr;
-    ip_addr_t self, peer;
-    uint32_t pseudo = 0;
-
-    memset(&segment, 0, sizeof(segment));
-    hdr = (struct tcp_hdr *)segment;
-    hdr->src = cb->port;
-    hdr->dst = cb->peer.port;
-    hdr->seq = hton32(seq);
-    hdr->ack = hton32(ack);
-    hdr->off = (sizeof(struct tcp_hdr) >> 2) << 4;
-    hdr->flg = flg;
-    hdr->win = hton16(cb->rcv.wnd);
-    hdr->sum = 0;
-    hdr->urg = 0;
+/*
+ * A segment for a connection in TIME_WAIT. A retransmitted FIN means
+ * our last ACK was lost: ACK again and restart the 2MSL wait. A SYN
+ * that cannot belong to the old connection ends TIME_WAIT early (RFC
+ * 6191) and goes on to the listener. RSTs are ignored (RFC 1337), and
+ * so is everything else. Caller holds tcplock.
+ */
+static int
+tcp_tw_rx (struct tcp_tw *tw, struct tcp_hdr *hdr) {
+    struct tcp_opts opts;
+    int ts;
 
-    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)){
-        hdr->opt = 69;
-        hdr->size = 3;
-        hdr->tep = 0x99;
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
+        return TCP_TW_DROP;
     }
-
-    memcpy(hdr + 1, buf, len);
-    self = ((struct netif_ip *)cb->iface)->unicast;
-    peer = cb->peer.addr;
-    pseudo += (self >> 16) & 0xffff;
-    pseudo += self & 0xffff;
-    pseudo += (peer >> 16) & 0xffff;
-    pseudo += peer & 0xffff;
-    pseudo += hton16((uint16_t)IP_PROTOCOL_TCP);
-    pseudo += hton16(sizeof(struct tcp_hdr) + len);
-    hdr->sum = cksum16((uint16_t *)hdr, sizeof(struct tcp_hdr) + len, pseudo);
-    hexdump(&peer, sizeof(ip_addr_t));
-    ip_tx(cb->iface, IP_PROTOCOL_TCP, (uint8_t *)hdr, sizeof(struct tcp_hdr) + len, &peer);
-    tcp_txq_add(cb, hdr, sizeof(struct tcp_hdr) + len);
-    return len;
+    tcp_opt_parse(hdr, (hdr->off >> 4) << 2, &opts);
+    ts = tw->ts && (opts.flags & TCP_OPT_F_TS);
+    if (TCP_FLG_IS(hdr->flg, TCP_FLG_SYN)) {
+        if (ts ? TCP_SEQ_LT(tw->ts_recent, opts.tsval) : TCP_SEQ_LT(tw->rcv_nxt, ntoh32(hdr->seq))) {
+            tcp_tw_drop(tw);
+            return TCP_TW_REUSE;
+        }
+        return TCP_TW_DROP;
+    }
+    if (!TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN)) {
+        return TCP_TW_DROP;
+    }
+    if (ts) {
+        if (TCP_SEQ_LT(opts.tsval, tw->ts_recent)) {
+            return TCP_TW_DROP;
+        }
+        tw->ts_recent = opts.tsval;
+    }
+    tw->expire = tcp_deadline(TCP_TIMEWAIT_LEN);
+    return TCP_TW_ACK;
 }
 
 static void
 tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
-    uint32_t seq, ack;
+    uint32_t seq, ack, tsecr, end;
     size_t hlen, plen;
+    int holes;
     uint8_t init[8] = {0};
+    struct tcp_opts opts;
 
     hlen = ((hdr->off >> 4) << 2);
     plen = len - hlen;
+    tcp_opt_parse(hdr, hlen, &opts);
     switch (cb->state) {
         case TCP_CB_STATE_CLOSED:
             if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
@@ -287,35 +2021,6 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
             }
             tcp_tx(cb, seq, ack, TCP_FLG_RST, NULL, 0);
             return;
-        case TCP_CB_STATE_LISTEN:
-            if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
-                return;
-            }
-            if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
-                seq = ntoh32(hdr->ack);
-                ack = 0;
-                tcp_tx(cb, seq, ack, TCP_FLG_RST, NULL, 0);
-                return;
-            }
-            if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) { 
-                if (hdr->opt != 69){ 
-                    cprintf("SYN without TCP-ENO");
-                    seq = ntoh32(hdr->ack);
-                    ack = 0;
-                    tcp_tx(cb, seq, ack, TCP_FLG_RST, NULL, 0);
-                    return;
-                }
-                cb->rcv.nxt = ntoh32(hdr->seq) + 1;
-                cb->irs = ntoh32(hdr->seq);
-                cb->iss = (uint32_t)random();
-                seq = cb->iss;
-                ack = cb->rcv.nxt;
-                tcp_tx(cb, seq, ack, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
-                cb->snd.nxt = cb->iss + 1;
-                cb->snd.una = cb->iss;
-                cb->state = TCP_CB_STATE_SYN_RCVD;
-            }
-            return;
         case TCP_CB_STATE_SYN_SENT:
             if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
                 if (ntoh32(hdr->ack) <= cb->iss || ntoh32(hdr->ack) > cb->snd.nxt) {
@@ -337,8 +2042,12 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
                 cb->rcv.nxt = ntoh32(hdr->seq) + 1;
                 cb->irs = ntoh32(hdr->seq);
                 if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
+                    tcp_opt_negotiate(cb, &opts);
                     cb->snd.una = ntoh32(hdr->ack);
-                    // delete TX queue
+                    tcp_txq_ack(cb, cb->snd.una, (cb->opt & TCP_OPT_F_TS) ? opts.tsecr : 0);
+                    cb->snd.wnd = ntoh16(hdr->win);
+                    cb->snd.wl1 = ntoh32(hdr->seq);
+                    cb->snd.wl2 = ntoh32(hdr->ack);
                     if (cb->snd.una > cb->iss) {
                         cb->state = TCP_CB_STATE_ESTABLISHED;
                         seq = cb->snd.nxt;
@@ -358,11 +2067,33 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
         default:
             break;
     }
+    if ((cb->opt & TCP_OPT_F_TS) && (opts.flags & TCP_OPT_F_TS) && !TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST) &&
+        TCP_SEQ_LT(opts.tsval, cb->ts.recent) && ticks - cb->ts.recent_age < TCP_PAWS_IDLE) {
+        /* PAWS: an old duplicate from a wrapped sequence space */
+        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
+        return;
+    }
     if (ntoh32(hdr->seq) != cb->rcv.nxt) {
-        // TODO
+        if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
+            return;
+        }
+        if (plen && TCP_SEQ_LT(cb->rcv.nxt, ntoh32(hdr->seq)) && TCP_CB_STATE_RX_ISREADY(cb) &&
+            !TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
+            tcp_ooo_insert(cb, ntoh32(hdr->seq), (uint8_t *)hdr + hlen, plen);
+        }
+        /* a duplicate ACK, with SACK blocks, tells the peer what is missing */
+        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
         return;
     }
+    if ((opts.flags & TCP_OPT_F_TS) && TCP_SEQ_LEQ(ntoh32(hdr->seq), cb->last_ack_sent)) {
+        cb->ts.recent = opts.tsval;
+        cb->ts.recent_age = ticks;
+    }
     if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST | TCP_FLG_SYN)) {
+        if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST) && cb->orphan) {
+            /* nobody is left to tell */
+            tcp_cb_clear(cb);
+        }
         // TODO
         return;
     }
@@ -374,8 +2105,7 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
         case TCP_CB_STATE_SYN_RCVD:
             if (cb->snd.una <= ntoh32(hdr->ack) && ntoh32(hdr->ack) <= cb->snd.nxt) {
                 cb->state = TCP_CB_STATE_ESTABLISHED;
-                queue_push(&cb->parent->backlog, cb, sizeof(*cb));
-                wakeup(cb->parent);
+                tcp_cb_enqueue_accept(cb);
             } else {
                 tcp_tx(cb, ntoh32(hdr->ack), 0, TCP_FLG_RST, NULL, 0);
                 break;
@@ -385,48 +2115,78 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
         case TCP_CB_STATE_FIN_WAIT2:
         case TCP_CB_STATE_CLOSE_WAIT:
         case TCP_CB_STATE_CLOSING:
-            if (cb->snd.una < ntoh32(hdr->ack) && ntoh32(hdr->ack) <= cb->snd.nxt) {
-                cb->snd.una = ntoh32(hdr->ack);
-            } else if (ntoh32(hdr->ack) > cb->snd.nxt) {
+            ack = ntoh32(hdr->ack);
+            if (cb->opt & TCP_OPT_F_SACK) {
+                tcp_sack_update(cb, &opts);
+            }
+            if (TCP_SEQ_LT(cb->snd.una, ack) && TCP_SEQ_LEQ(ack, cb->snd.nxt)) {
+                seq = cb->snd.una;
+                cb->snd.una = ack;
+                tsecr = (cb->opt & TCP_OPT_F_TS) ? opts.tsecr : 0;
+                tcp_txq_ack(cb, ack, tsecr);
+                tcp_cong_ack(cb, ack - seq);
+            } else if (TCP_SEQ_LT(cb->snd.nxt, ack)) {
                 tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
                 return;
+            } else if (ack == cb->snd.una && cb->txq.head && !plen && cb->snd.wnd &&
+                       !TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN) && tcp_seg_wnd(cb, hdr) == cb->snd.wnd) {
+                /* not with the window shut: those ACKs answer probes, not losses */
+                tcp_cong_dupack(cb);
+            }
+            if (TCP_SEQ_LEQ(cb->snd.una, ntoh32(hdr->ack))) {
+                tcp_update_window(cb, hdr);
+            }
+            if (!cb->snd.wnd && cb->persist.probes) {
+                /* the peer is alive, just not reading: start the backoff over */
+                cb->persist.probes = 0;
+                tcp_timer_arm(cb, &cb->persist.timer, tcp_persist_len(cb));
             }
-            // send window update
+            tcp_output(cb);
+            wakeup(cb); /* send buffer space */
             if (cb->state == TCP_CB_STATE_FIN_WAIT1) {
                 if (ntoh32(hdr->ack) == cb->snd.nxt) {
                     cb->state = TCP_CB_STATE_FIN_WAIT2;
+                    if (cb->orphan) {
+                        /* don't wait forever for a peer that never closes */
+                        tcp_timer_set(cb, TCP_FIN_TIMEOUT);
+                    }
                 }
             } else if (cb->state == TCP_CB_STATE_CLOSING) {
                 if (ntoh32(hdr->ack) == cb->snd.nxt) {
-                    cb->state = TCP_CB_STATE_TIME_WAIT;
-                    wakeup(cb);
+                    tcp_tw_enter(cb);
                 }
                 return;
             }
             break;
         case TCP_CB_STATE_LAST_ACK:
-            wakeup(cb);
-            tcp_cb_clear(cb); /* TCP_CB_STATE_CLOSED */
+            if (ntoh32(hdr->ack) == cb->snd.nxt) {
+                tcp_cb_clear(cb);
+            }
             return;
     }
+    end = ntoh32(hdr->seq) + plen;
     if (plen) {
         switch (cb->state) {
             case TCP_CB_STATE_ESTABLISHED:
             case TCP_CB_STATE_FIN_WAIT1:
             case TCP_CB_STATE_FIN_WAIT2:
+                acquire(&keylock);
                 if (private_key && !shared_key) {
                     if (*((uint32_t*)((uint8_t *)hdr + hlen)) != INIT_MAGIC){
+                        release(&keylock);
                         tcp_tx(cb, ntoh32(hdr->ack), 0, TCP_FLG_RST, NULL, 0);
-                        break
+                        break;
                     }
                     shared_key = mod_exp(*((uint32_t*)((uint8_t *)hdr + hlen + sizeof(uint32_t))), private_key, PRIME);
                 }
-                memcpy(cb->window + (sizeof(cb->window) - cb->rcv.wnd), (uint8_t *)hdr + hlen, plen);
+                release(&keylock);
+                plen = tcp_buf_write(&cb->rcvbuf, (uint8_t *)hdr + hlen, plen);
                 cb->rcv.nxt = ntoh32(hdr->seq) + plen;
-                cb->rcv.wnd -= plen;
-                seq = cb->snd.nxt;
-                ack = cb->rcv.nxt;
-                tcp_tx(cb, seq, ack, TCP_FLG_ACK, NULL, 0);
+                /* a full buffer or a filled gap is news to the sender */
+                holes = cb->ooo.n;
+                tcp_ooo_drain(cb);
+                cb->rcv.wnd = cb->rcvbuf.size - cb->rcvbuf.len;
+                tcp_delack(cb, !plen || holes);
                 wakeup(cb);
                 break;
             default:
@@ -434,6 +2194,10 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
         }
     }
     if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN)) {
+        if (cb->rcv.nxt != end) {
+            /* data before the FIN did not fit; it comes again, FIN and all */
+            return;
+        }
         cb->rcv.nxt++;
         tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
         switch (cb->state) {
@@ -443,11 +2207,11 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
                 wakeup(cb);
                 break;
             case TCP_CB_STATE_FIN_WAIT1:
-                cb->state = TCP_CB_STATE_FIN_WAIT2;
+                /* our FIN is still unacknowledged */
+                cb->state = TCP_CB_STATE_CLOSING;
                 break;
             case TCP_CB_STATE_FIN_WAIT2:
-                cb->state = TCP_CB_STATE_TIME_WAIT;
-                wakeup(cb);
+                tcp_tw_enter(cb);
                 break;
             default:
                 break;
@@ -457,18 +2221,291 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
     return;
 }
 
+static const uint16_t tcp_syncookie_mss[] = { 256, 536, 1024, 1220, 1360, 1440, 1452, 1460 };
+
+static uint32_t
+tcp_mix (uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t
+tcp_syncookie_hash (struct tcp_req *req, uint32_t t) {
+    uint32_t h;
+
+    h = tcp_mix(tcp_syncookie_secret ^ ((struct netif_ip *)req->iface)->unicast);
+    h = tcp_mix(h ^ req->peer.addr);
+    h = tcp_mix(h ^ ((uint32_t)req->port << 16 | req->peer.port));
+    h = tcp_mix(h ^ req->irs);
+    return tcp_mix(h ^ t);
+}
+
+/*
+ * A SYN cookie (RFC 4987 3.6) is an ISS that carries the handshake:
+ * 5 bits of time, 3 bits of MSS index and 24 bits of a keyed hash over
+ * the connection and the time. Nothing else survives, so connections
+ * opened this way go without window scaling, timestamps and SACK.
+ */
+static uint32_t
+tcp_syncookie_make (struct tcp_req *req) {
+    uint32_t t, idx;
+
+    t = ticks / TCP_SYNCOOKIE_PERIOD;
+    idx = NELEM(tcp_syncookie_mss) - 1;
+    while (idx > 0 && tcp_syncookie_mss[idx] > req->syn.mss) {
+        idx--;
+    }
+    return (t & 0x1f) << 27 | idx << 24 | (tcp_syncookie_hash(req, t) & 0xffffff);
+}
+
+/* Check the cookie returned in req->iss and recover the MSS from it. */
+static int
+tcp_syncookie_check (struct tcp_req *req) {
+    uint32_t t;
+    int age;
+
+    t = ticks / TCP_SYNCOOKIE_PERIOD;
+    for (age = 0; age < 2; age++, t--) {
+        if ((t & 0x1f) == req->iss >> 27 && (tcp_syncookie_hash(req, t) & 0xffffff) == (req->iss & 0xffffff)) {
+            req->syn.mss = tcp_syncookie_mss[(req->iss >> 24) & 0x7];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void
+tcp_req_tx (struct tcp_req *req) {
+    struct tcp_hdr hdr;
+    uint8_t opt[TCP_OPT_LEN_MAX];
+    size_t optlen;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.src = req->port;
+    hdr.dst = req->peer.port;
+    hdr.seq = hton32(req->iss);
+    hdr.ack = hton32(req->irs + 1);
+    hdr.flg = TCP_FLG_SYN | TCP_FLG_ACK;
+    hdr.win = hton16(req->rcv_wnd);
+    optlen = tcp_opt_syn(opt, req->iface, req->opt, req->rcv_wscale, req->syn.tsval);
+    tcp_segment_tx(req->iface, req->peer.addr, &hdr, opt, optlen, NULL, 0);
+}
+
+/*
+ * Reset the sender of a segment that belongs to no connection
+ * (RFC 793 3.4). An RST is never answered.
+ */
+static void
+tcp_reset_tx (struct netif *iface, ip_addr_t peer, struct tcp_hdr *hdr, size_t len) {
+    struct tcp_hdr rst;
+    uint32_t ack;
+
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
+        return;
+    }
+    memset(&rst, 0, sizeof(rst));
+    rst.src = hdr->dst;
+    rst.dst = hdr->src;
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
+        rst.seq = hdr->ack;
+        rst.flg = TCP_FLG_RST;
+    } else {
+        ack = ntoh32(hdr->seq) + len - ((hdr->off >> 4) << 2);
+        if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
+            ack++;
+        }
+        if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN)) {
+            ack++;
+        }
+        rst.ack = hton32(ack);
+        rst.flg = TCP_FLG_RST | TCP_FLG_ACK;
+    }
+    tcp_segment_tx(iface, peer, &rst, NULL, 0, NULL, 0);
+}
+
+/* Resend the SYN-ACK with backoff, until TCP_SYNACK_RETRIES. */
+static void
+tcp_req_timeout (void *arg) {
+    struct tcp_req *req = arg, synack;
+    int resend = 0;
+
+    acquire(&tcplock);
+    if (req->dead) {
+        kmem_cache_free(tcp_req_cache, req);
+    } else if (req->retries == TCP_SYNACK_RETRIES) {
+        tcp_req_unhash(req);
+        kmem_cache_free(tcp_req_cache, req);
+    } else {
+        req->retries++;
+        timer_arm(&req->timer, MIN(TCP_RTO_INIT << req->retries, TCP_RTO_MAX));
+        synack = *req;
+        resend = 1;
+    }
+    release(&tcplock);
+    if (resend) {
+        tcp_req_tx(&synack);
+    }
+}
+
+/*
+ * A SYN for listener lcb. Record it in the SYN_RCVD table, or answer
+ * with a cookie when the table is full; either way *synack gets what
+ * the SYN-ACK needs. Returns -1, sending nothing, while the accept
+ * queue is full so that the peer retries later, and 1 for a SYN that
+ * is to be reset. Caller holds tcplock.
+ */
+static int
+tcp_req_syn (struct tcp_cb *lcb, struct netif *iface, ip_addr_t peer, struct tcp_hdr *hdr, struct tcp_req *synack) {
+    struct tcp_req *req, **head;
+
+    req = tcp_lookup_req(iface, hdr->dst, peer, hdr->src);
+    if (req) {
+        /* the SYN was retransmitted; so is the SYN-ACK */
+        *synack = *req;
+        return 0;
+    }
+    if (lcb->backlog_len >= lcb->backlog_max) {
+        return -1;
+    }
+    memset(synack, 0, sizeof(*synack));
+    tcp_opt_parse(hdr, (hdr->off >> 4) << 2, &synack->syn);
+    if (!synack->syn.eno) {
+        return 1;
+    }
+    if (!synack->syn.mss) {
+        synack->syn.mss = TCP_MSS_DEFAULT;
+    }
+    synack->syn.mss = MAX(synack->syn.mss, TCP_MSS_MIN);
+    synack->listener = lcb;
+    synack->iface = iface;
+    synack->port = hdr->dst;
+    synack->peer.addr = peer;
+    synack->peer.port = hdr->src;
+    synack->irs = ntoh32(hdr->seq);
+    synack->snd_wnd = ntoh16(hdr->win);
+    synack->rcv_wnd = MIN(lcb->rcvbuf.size, 0xffff);
+    if (lcb->syn_len >= lcb->backlog_max || !(req = kmem_cache_alloc(tcp_req_cache))) {
+        /* SYN flood: stay stateless */
+        synack->iss = tcp_syncookie_make(synack);
+        lcb->syncookies = 1;
+        lcb->syncookie_sent = ticks;
+        return 0;
+    }
+    synack->iss = (uint32_t)random();
+    synack->opt = synack->syn.flags;
+    if (synack->opt & TCP_OPT_F_WS) {
+        synack->rcv_wscale = tcp_rcv_wscale(lcb->rcvbuf.size);
+    }
+    *req = *synack;
+    head = &syn_hash[tcp_hashfn(req->port, req->peer.addr, req->peer.port)];
+    req->next = *head;
+    *head = req;
+    lcb->syn_len++;
+    timer_init(&req->timer, tcp_req_timeout, req);
+    timer_arm(&req->timer, TCP_RTO_INIT);
+    return 0;
+}
+
+/*
+ * The ACK that completes a passive open. Turn the pending request, or
+ * the cookie the ACK returns, into a control block in SYN_RCVD; the
+ * segment itself then takes it to ESTABLISHED and onto the accept
+ * queue. Caller holds tcplock.
+ */
+static struct tcp_cb *
+tcp_req_establish (struct tcp_cb *lcb, struct netif *iface, ip_addr_t peer, struct tcp_hdr *hdr) {
+    struct tcp_req *req, tmp;
+    struct tcp_cb *cb;
+
+    if (lcb->backlog_len >= lcb->backlog_max) {
+        return NULL; /* the peer retransmits; accept may have caught up by then */
+    }
+    req = tcp_lookup_req(iface, hdr->dst, peer, hdr->src);
+    if (req) {
+        if (ntoh32(hdr->ack) != req->iss + 1) {
+            return NULL;
+        }
+        tmp = *req;
+    } else {
+        memset(&tmp, 0, sizeof(tmp));
+        tmp.iface = iface;
+        tmp.port = hdr->dst;
+        tmp.peer.addr = peer;
+        tmp.peer.port = hdr->src;
+        tmp.irs = ntoh32(hdr->seq) - 1;
+        tmp.iss = ntoh32(hdr->ack) - 1;
+        tmp.snd_wnd = ntoh16(hdr->win);
+        /* only while a cookie this listener sent may still be live */
+        if (!lcb->syncookies || ticks - lcb->syncookie_sent > 2 * TCP_SYNCOOKIE_PERIOD) {
+            return NULL;
+        }
+        if (tcp_syncookie_check(&tmp) == -1) {
+            return NULL;
+        }
+    }
+    cb = tcp_cb_alloc();
+    if (!cb) {
+        return NULL;
+    }
+    cb->rcvbuf.size = lcb->rcvbuf.size;
+    cb->sndbuf.size = lcb->sndbuf.size;
+    cb->cc_ops = lcb->cc_ops;
+    cb->nodelay = lcb->nodelay;
+    if (tcp_cb_conn_init(cb, iface) == -1) {
+        kmem_cache_free(tcp_cb_cache, cb);
+        return NULL;
+    }
+    cb->iface = iface;
+    tcp_bind_port(cb, tmp.port);
+    cb->peer.addr = tmp.peer.addr;
+    cb->peer.port = tmp.peer.port;
+    cb->parent = lcb;
+    cb->irs = tmp.irs;
+    cb->rcv.nxt = tmp.irs + 1;
+    cb->iss = tmp.iss;
+    cb->snd.una = tmp.iss;
+    cb->snd.nxt = tmp.iss + 1;
+    cb->recover = cb->sack.high = tmp.iss;
+    cb->snd.wnd = tmp.snd_wnd;
+    cb->snd.wl1 = tmp.irs;
+    cb->snd.wl2 = tmp.iss;
+    cb->opt = tmp.opt;
+    tcp_opt_negotiate(cb, &tmp.syn);
+    cb->last_ack_sent = cb->rcv.nxt;
+    cb->state = TCP_CB_STATE_SYN_RCVD;
+    tcp_hash_conn(cb);
+    if (req) {
+        tcp_req_drop(req);
+    }
+    return cb;
+}
+
 static void
-tcp_rx (uint8_t *segment, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *iface) {
+tcp_rx (struct pbuf *pb, ip_addr_t *src, ip_addr_t *dst, struct netif *iface) {
     struct tcp_hdr *hdr;
     uint32_t pseudo = 0;
-    struct tcp_cb *cb, *fcb = NULL, *lcb = NULL;
+    struct tcp_cb *cb, *lcb;
+    struct tcp_req *req, synack;
+    struct tcp_tw *tw, twack;
+    size_t len = pb->len;
+    int ret;
     if (*dst != ((struct netif_ip *)iface)->unicast) {
+        pbuf_free(pb);
         return;
     }
     if (len < sizeof(struct tcp_hdr)) {
+        pbuf_free(pb);
+        return;
+    }
+    hdr = (struct tcp_hdr *)pb->data;
+    if (((hdr->off >> 4) << 2) < sizeof(struct tcp_hdr) || ((hdr->off >> 4) << 2) > len) {
+        pbuf_free(pb);
         return;
     }
-    hdr = (struct tcp_hdr *)segment;
     pseudo += *src >> 16;
     pseudo += *src & 0xffff;
     pseudo += *dst >> 16;
@@ -480,44 +2517,66 @@ tcp_rx (uint8_t *segment, size_t len, ip_addr_t *src, ip_addr_t *dst, struct net
         //return;
     }
     acquire(&tcplock);
-    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-        if (!cb->used) {
-            if (!fcb) {
-                fcb = cb;
-            }
-        }
-        else if ((!cb->iface || cb->iface == iface) && cb->port == hdr->dst) {
-            if (cb->peer.addr == *src && cb->peer.port == hdr->src) {
-                if (TCP_FLG_IS(hdr->flg, TCP_FLG_SYN | TCP_FLG_ACK)){
-                    cb->used = 1;
-                    cb->iface = iface;
-                }
+    cb = tcp_lookup_conn(iface, hdr->dst, *src, hdr->src);
+    if (!cb && (tw = tcp_lookup_tw(iface, hdr->dst, *src, hdr->src)) != NULL) {
+        switch (tcp_tw_rx(tw, hdr)) {
+            case TCP_TW_REUSE:
                 break;
+            case TCP_TW_ACK:
+                twack = *tw;
+                release(&tcplock);
+                tcp_tw_tx(&twack);
+                pbuf_free(pb);
+                return;
+            default:
+                release(&tcplock);
+                pbuf_free(pb);
+                return;
+        }
+    }
+    if (!cb) {
+        lcb = tcp_lookup_listener(iface, hdr->dst);
+        if (lcb && TCP_FLG_IS(hdr->flg, TCP_FLG_SYN)) {
+            ret = tcp_req_syn(lcb, iface, *src, hdr, &synack);
+            release(&tcplock);
+            if (ret == 0) {
+                tcp_req_tx(&synack);
+            } else if (ret == 1) {
+                tcp_reset_tx(iface, *src, hdr, len);
             }
-            if (cb->state == TCP_CB_STATE_LISTEN && !lcb) {
-                lcb = cb;
+            pbuf_free(pb);
+            return;
+        }
+        if (lcb && TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
+            req = tcp_lookup_req(iface, hdr->dst, *src, hdr->src);
+            if (req && ntoh32(hdr->seq) == req->irs + 1) {
+                tcp_req_drop(req);
             }
         }
-    }
-    if (cb == array_tailof(cb_table)) {
-        if (!lcb || !fcb || !TCP_FLG_IS(hdr->flg, TCP_FLG_SYN)) {
-            tcp_tx(cb, ntoh32(hdr->ack), 0, TCP_FLG_RST, NULL, 0);
+        if (!lcb || !TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK) || TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN | TCP_FLG_RST) ||
+            !(cb = tcp_req_establish(lcb, iface, *src, hdr))) {
             release(&tcplock);
+            if (!lcb) {
+                /* nobody at this port: tell the peer instead of letting it retry */
+                tcp_reset_tx(iface, *src, hdr, len);
+            }
+            pbuf_free(pb);
             return;
         }
-        cb = fcb;
-        cb->used = 1;
-        cb->state = lcb->state;
-        cb->iface = iface;
-        cb->port = lcb->port;
-        cb->peer.addr = *src;
-        cb->peer.port = hdr->src;
-        cb->rcv.wnd = sizeof(cb->window);
-        cb->parent = lcb;
-    }
- 
-    tcp_incoming_event(cb, hdr, len);
+    }
+    cb->ref++;
     release(&tcplock);
+
+    acquire(&cb->lock);
+    if (!cb->dead) {
+        if (TCP_FLG_IS(hdr->flg, TCP_FLG_SYN | TCP_FLG_ACK)){
+            cb->iface = iface;
+        }
+        tcp_incoming_event(cb, hdr, len);
+    }
+    release(&cb->lock);
+    tcp_cb_put(cb);
+    pbuf_free(pb);
     return;
 }
 
@@ -525,150 +2584,181 @@ int
 tcp_api_open (void) {
     struct tcp_cb *cb;
 
-    acquire(&tcplock);
-    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-        if (!cb->used) {
-            cb->used = 1;
-            release(&tcplock);
-            return array_offset(cb_table, cb);
-        }
+    cb = tcp_cb_alloc();
+    if (!cb) {
+        return -1;
     }
+    acquire(&tcplock);
+    cb->desc = desc_alloc(&tcp_descs, cb);
     release(&tcplock);
-    return -1;
+    if (cb->desc == -1) {
+        tcp_cb_put(cb);
+        return -1;
+    }
+    return cb->desc;
 }
 
 int
 tcp_api_close (int soc) {
     struct tcp_cb *cb;
 
-    if (TCP_SOCKET_ISINVALID(soc)) {
+    cb = tcp_cb_get(soc);
+    if (!cb) {
         return -1;
     }
-    acquire(&tcplock);
-    cb = &cb_table[soc];
-    if (!cb->used) {
-        release(&tcplock);
+    acquire(&cb->lock);
+    if (cb->dead) {
+        release(&cb->lock);
+        tcp_cb_put(cb);
         return -1;
     }
+    /* the FIN goes after everything already queued */
+    cb->cork = 0;
+    tcp_output(cb);
+    while (cb->sndbuf.len && TCP_CB_STATE_TX_ISREADY(cb)) {
+        sleep(cb, &cb->lock);
+    }
     switch (cb->state) {
         case TCP_CB_STATE_SYN_RCVD:
         case TCP_CB_STATE_ESTABLISHED:
             tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_FIN | TCP_FLG_ACK, NULL, 0);
             cb->state = TCP_CB_STATE_FIN_WAIT1;
             cb->snd.nxt++;
-            sleep(cb, &tcplock);
+            cb->orphan = 1;
             break;
         case TCP_CB_STATE_CLOSE_WAIT:
             tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_FIN | TCP_FLG_ACK, NULL, 0);
             cb->state = TCP_CB_STATE_LAST_ACK;
             cb->snd.nxt++;
-            sleep(cb, &tcplock);
+            cb->orphan = 1;
             break;
         default:
             break;
     }
-    tcp_cb_clear(cb); /* TCP_CB_STATE_CLOSED */
-    release(&tcplock);
+    if (cb->orphan) {
+        /* the FIN exchange finishes without us; the tables keep cb alive */
+        acquire(&tcplock);
+        if (cb->desc != -1) {
+            desc_free(&tcp_descs, cb->desc);
+            cb->desc = -1;
+        }
+        release(&tcplock);
+    } else if (!cb->dead) {
+        tcp_cb_clear(cb); /* TCP_CB_STATE_CLOSED */
+    }
+    release(&cb->lock);
+    tcp_cb_put(cb);
     return 0;
 }
 
 int
 tcp_api_connect (int soc, struct sockaddr *addr, int addrlen) {
     struct sockaddr_in *sin;
-    struct tcp_cb *cb, *tmp;
-    uint32_t p;
+    struct tcp_cb *cb;
+    struct netif *iface;
+    int ret;
 
-    if (TCP_SOCKET_ISINVALID(soc)) {
-        return -1;
-    }
     if (addr->sa_family != AF_INET) {
         return -1;
     }
     sin = (struct sockaddr_in *)addr;
-    acquire(&tcplock);
-    cb = &cb_table[soc];
-    if (!cb->used || cb->state != TCP_CB_STATE_CLOSED) {
-        release(&tcplock);
+    cb = tcp_cb_get(soc);
+    if (!cb) {
         return -1;
     }
-    if (!cb->port) {
-        int offset = time(NULL) % 1024;
-        for (p = TCP_SOURCE_PORT_MIN + offset; p <= TCP_SOURCE_PORT_MAX; p++) {
-            for (tmp = cb_table; tmp < array_tailof(cb_table); tmp++) {
-                if (tmp->used && tmp->port == hton16((uint16_t)p)) {
-                    break;
-                }
-            }
-            if (tmp == array_tailof(cb_table)) {
-                cb->port = hton16((uint16_t)p);
-                break;
-            }
-        }
-        if (!cb->port) {
-            release(&tcplock);
-            return -1;
-        }
+    acquire(&cb->lock);
+    if (cb->dead || cb->state != TCP_CB_STATE_CLOSED || cb->hashed != TCP_HASHED_NONE) {
+        release(&cb->lock);
+        tcp_cb_put(cb);
+        return -1;
+    }
+    iface = cb->iface ? cb->iface : ip_netif_by_peer(&sin->sin_addr);
+    if (!iface || (!cb->rcvbuf.buf && tcp_cb_conn_init(cb, iface) == -1)) {
+        release(&cb->lock);
+        tcp_cb_put(cb);
+        return -1;
     }
+    cb->iface = iface;
     cb->peer.addr = sin->sin_addr;
     cb->peer.port = sin->sin_port;
-    cb->rcv.wnd = sizeof(cb->window);
+    acquire(&tcplock);
+    if (cb->port ? tcp_tw_busy(iface, cb->port, cb->peer.addr, cb->peer.port) : tcp_bind_ephemeral(cb) == -1) {
+        release(&tcplock);
+        release(&cb->lock);
+        tcp_cb_put(cb);
+        return -1;
+    }
+    tcp_hash_conn(cb);
+    release(&tcplock);
+    cb->opt = TCP_OPT_F_WS | TCP_OPT_F_TS | TCP_OPT_F_SACK;
+    cb->rcv.wscale = tcp_rcv_wscale(cb->rcvbuf.size);
     cb->iss = (uint32_t)random();
+    cb->recover = cb->iss;
+    cb->sack.high = cb->iss;
     tcp_tx(cb, cb->iss, 0, TCP_FLG_SYN, NULL, 0);
+    cb->snd.una = cb->iss;
     cb->snd.nxt = cb->iss + 1;
     cb->state = TCP_CB_STATE_SYN_SENT;
     while (cb->state == TCP_CB_STATE_SYN_SENT) {
-        sleep(&cb_table[soc], &tcplock);
+        sleep(cb, &cb->lock);
     }
-
-    release(&tcplock);
-    return 0;
+    ret = cb->state == TCP_CB_STATE_ESTABLISHED ? 0 : -1;
+    if (ret == -1 && cb->state == TCP_CB_STATE_CLOSED) {
+        tcp_connect_abort(cb);
+    }
+    release(&cb->lock);
+    tcp_cb_put(cb);
+    return ret;
 }
 
 int
 tcp_api_bind (int soc, struct sockaddr *addr, int addrlen) {
     struct sockaddr_in *sin;
     struct tcp_cb *cb;
+    int ret = -1;
 
-    if (TCP_SOCKET_ISINVALID(soc)) {
-        return -1;
-    }
     if (addr->sa_family != AF_INET) {
         return -1;
     }
     sin = (struct sockaddr_in *)addr;
-    acquire(&tcplock);
-    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-        if (cb->port == sin->sin_port) {
-            release(&tcplock);
-            return -1;
-        }
-    }
-    cb = &cb_table[soc];
-    if (!cb->used || cb->state != TCP_CB_STATE_CLOSED) {
-        release(&tcplock);
+    cb = tcp_cb_get(soc);
+    if (!cb) {
         return -1;
     }
-    cb->port = sin->sin_port;
+    acquire(&cb->lock);
+    acquire(&tcplock);
+    if (!cb->dead && cb->state == TCP_CB_STATE_CLOSED && !cb->port && !tcp_port_inuse(sin->sin_port)) {
+        tcp_bind_port(cb, sin->sin_port);
+        ret = 0;
+    }
     release(&tcplock);
-    return 0;
+    release(&cb->lock);
+    tcp_cb_put(cb);
+    return ret;
 }
 
 int
 tcp_api_listen (int soc, int backlog) {
     struct tcp_cb *cb;
+    int ret = -1;
 
-    if (TCP_SOCKET_ISINVALID(soc)) {
+    cb = tcp_cb_get(soc);
+    if (!cb) {
         return -1;
     }
-    acquire(&tcplock);
-    cb = &cb_table[soc];
-    if (!cb->used || cb->state != TCP_CB_STATE_CLOSED || !cb->port) {
+    acquire(&cb->lock);
+    if (!cb->dead && cb->state == TCP_CB_STATE_CLOSED && cb->port) {
+        cb->state = TCP_CB_STATE_LISTEN;
+        cb->backlog_max = MIN(MAX(backlog, 1), TCP_CB_LISTENER_SIZE);
+        tcp_buf_free(&cb->sndbuf); /* a listener never sends; only the size is inherited */
+        acquire(&tcplock);
+        tcp_hash_listen(cb);
         release(&tcplock);
-        return -1;
+        ret = 0;
     }
-    cb->state = TCP_CB_STATE_LISTEN;
-    release(&tcplock);
-    return 0;
+    release(&cb->lock);
+    tcp_cb_put(cb);
+    return ret;
 }
 
 int
@@ -676,10 +2766,8 @@ tcp_api_accept (int soc, struct sockaddr *addr, int *addrlen) {
     struct tcp_cb *cb, *backlog;
     struct queue_entry *entry;
     struct sockaddr_in *sin = NULL;
+    int desc;
 
-    if (TCP_SOCKET_ISINVALID(soc)) {
-        return -1;
-    }
     if (addr) {
         if (!addrlen) {
             return -1;
@@ -690,84 +2778,206 @@ tcp_api_accept (int soc, struct sockaddr *addr, int *addrlen) {
         *addrlen = sizeof(struct sockaddr_in);
         sin = (struct sockaddr_in *)addr;
     }
+    cb = tcp_cb_get(soc);
+    if (!cb) {
+        return -1;
+    }
+    /* the backlog belongs to tcplock, so wait there rather than on cb->lock */
     acquire(&tcplock);
-    cb = &cb_table[soc];
-    if (!cb->used) {
+    while (!cb->dead && cb->hashed == TCP_HASHED_LISTEN && (entry = queue_pop(&cb->backlog)) == NULL) {
+        sleep(&cb->backlog, &tcplock);
+    }
+    if (cb->dead || cb->hashed != TCP_HASHED_LISTEN) {
         release(&tcplock);
+        tcp_cb_put(cb);
         return -1;
     }
-    if (cb->state != TCP_CB_STATE_LISTEN) {
+    backlog = entry->data;
+    kmfree(entry);
+    cb->backlog_len--;
+    backlog->parent = NULL;
+    backlog->desc = desc_alloc(&tcp_descs, backlog);
+    if (backlog->desc == -1) {
+        backlog->ref++;
         release(&tcplock);
+        tcp_cb_put(cb);
+        acquire(&backlog->lock);
+        if (!backlog->dead) {
+            tcp_cb_clear(backlog);
+        }
+        release(&backlog->lock);
+        tcp_cb_put(backlog);
         return -1;
     }
-    while ((entry = queue_pop(&cb->backlog)) == NULL) {
-        sleep(cb, &tcplock);
-    }
-    backlog = entry->data;
-    kfree((char*)entry);
+    desc = backlog->desc;
     if (sin) {
       sin->sin_family = AF_INET;
       sin->sin_addr = backlog->peer.addr;
       sin->sin_port = backlog->peer.port;
     }
     release(&tcplock);
-    return array_offset(cb_table, backlog);
+    tcp_cb_put(cb);
+    return desc;
 }
 
 ssize_t
 tcp_api_recv (int soc, uint8_t *buf, size_t size) {
     struct tcp_cb *cb;
-    size_t total, len;
+    size_t len;
 
-    if (TCP_SOCKET_ISINVALID(soc)) {
+    cb = tcp_cb_get(soc);
+    if (!cb) {
         return -1;
     }
-    acquire(&tcplock);
-    cb = &cb_table[soc];
-    if (!cb->used) {
-        release(&tcplock);
+    acquire(&cb->lock);
+    if (!cb->rcvbuf.buf) {
+        release(&cb->lock);
+        tcp_cb_put(cb);
         return -1;
     }
-    while (!(total = sizeof(cb->window) - cb->rcv.wnd)) {
+    while (!cb->rcvbuf.len) {
         if (!TCP_CB_STATE_RX_ISREADY(cb)) {
-            release(&tcplock);
+            release(&cb->lock);
+            tcp_cb_put(cb);
             return 0;
         }
-        sleep(cb, &tcplock);
+        sleep(cb, &cb->lock);
     }
-    len = size < total ? size : total;
-    memcpy(buf, cb->window, len);
+    len = tcp_buf_read(&cb->rcvbuf, buf, size);
     encdec(buf, len);
-    memmove(cb->window, cb->window + len, total - len);
-    cb->rcv.wnd += len;
-    release(&tcplock);
+    cb->rcv.wnd = cb->rcvbuf.size - cb->rcvbuf.len;
+    /* window update once the right edge moves enough to matter (RFC 1122 4.2.3.3) */
+    if (TCP_CB_STATE_RX_ISREADY(cb) &&
+        TCP_SEQ_LEQ(cb->last_ack_sent + cb->rcv.adv + MIN(cb->mss, cb->rcvbuf.size / 2), cb->rcv.nxt + cb->rcv.wnd)) {
+        tcp_delack(cb, 1);
+    }
+    release(&cb->lock);
+    tcp_cb_put(cb);
     return len;
 }
 
+/*
+ * Queue data for sending and return; tcp_output segments it. Blocks
+ * only while the send buffer is full.
+ */
 ssize_t
 tcp_api_send (int soc, uint8_t *buf, size_t len) {
     struct tcp_cb *cb;
+    struct tcp_buf *sb;
+    size_t done = 0, n, k;
+    uint32_t tail;
 
-    if (TCP_SOCKET_ISINVALID(soc)) {
+    cb = tcp_cb_get(soc);
+    if (!cb) {
         return -1;
     }
-    acquire(&tcplock);
-    cb = &cb_table[soc];
-    if (!cb->used) {
-        release(&tcplock);
-        return -1;
+    acquire(&cb->lock);
+    sb = &cb->sndbuf;
+    while (done < len && TCP_CB_STATE_TX_ISREADY(cb)) {
+        tail = (sb->head + sb->len) & (sb->size - 1);
+        n = tcp_buf_write(sb, buf + done, len - done);
+        if (!n) {
+            sleep(cb, &cb->lock);
+            continue;
+        }
+        /* encrypt in the buffer, leaving the caller's copy alone */
+        k = MIN(n, sb->size - tail);
+        encdec(sb->buf + tail, k);
+        encdec(sb->buf, n - k);
+        done += n;
+        tcp_output(cb);
     }
-    if (!TCP_CB_STATE_TX_ISREADY(cb)) {
-        release(&tcplock);
-        return -1;
+    release(&cb->lock);
+    tcp_cb_put(cb);
+    return (done || !len) ? (ssize_t)done : -1;
+}
+
+/* Round a buffer size up to a power of 2 the allocator can give us. */
+static uint32_t
+tcp_buf_size (int len) {
+    uint32_t size = TCP_BUF_MIN;
+
+    while (size < len && size < TCP_BUF_MAX) {
+        size <<= 1;
     }
+    return size;
+}
 
-    encdec(buf, len);
+int
+tcp_api_setsockopt (int soc, int level, int name, void *val, int len) {
+    struct tcp_cb *cb;
+    struct tcp_cong_ops *ops;
+    char cong[TCP_CONG_NAME_MAX];
+    int v = 0, ret = 0;
 
-    tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK | TCP_FLG_PSH, buf, len);
-    cb->snd.nxt += len;
-    release(&tcplock);
-    return 0;
+    if (level == SOL_SOCKET || (level == IPPROTO_TCP && name != TCP_CONGESTION)) {
+        if (len < sizeof(int)) {
+            return -1;
+        }
+        v = *(int *)val;
+    }
+    cb = tcp_cb_get(soc);
+    if (!cb) {
+        return -1;
+    }
+    acquire(&cb->lock);
+    if (level == SOL_SOCKET) {
+        switch (name) {
+        case SO_RCVBUF:
+        case SO_SNDBUF:
+            if (cb->rcvbuf.buf || v <= 0 || v > TCP_BUF_MAX) {
+                /* the buffers are fixed once the connection opens */
+                ret = -1;
+            } else if (name == SO_RCVBUF) {
+                cb->rcvbuf.size = tcp_buf_size(v);
+            } else {
+                /*
+                 * Past a page the buffer comes from the buddy pool, which
+                 * the NIC rings share; take it now so that running out
+                 * fails here rather than in connect().
+                 */
+                tcp_buf_free(&cb->sndbuf);
+                cb->sndbuf.size = tcp_buf_size(v);
+                if (cb->sndbuf.size > PGSIZE && tcp_buf_alloc(&cb->sndbuf) == -1) {
+                    cb->sndbuf.size = TCP_SNDBUF_DEFAULT;
+                    ret = -1;
+                }
+            }
+            break;
+        default:
+            ret = -1;
+            break;
+        }
+    } else if (level == IPPROTO_TCP) {
+        switch (name) {
+        case TCP_NODELAY:
+            cb->nodelay = !!v;
+            tcp_output(cb);
+            break;
+        case TCP_CORK:
+            cb->cork = !!v;
+            tcp_output(cb);
+            break;
+        case TCP_CONGESTION:
+            safestrcpy(cong, val, MIN(len + 1, (int)sizeof(cong)));
+            ops = tcp_cong_find(cong);
+            if (!ops) {
+                ret = -1;
+                break;
+            }
+            cb->cc_ops = ops;
+            cb->cc_ops->init(&cb->cc);
+            break;
+        default:
+            ret = -1;
+            break;
+        }
+    } else {
+        ret = -1;
+    }
+    release(&cb->lock);
+    tcp_cb_put(cb);
+    return ret;
 }
 
 int
@@ -775,6 +2985,15 @@ tcp_init (void) {
     struct tcp_cb *cb;
 
     initlock(&tcplock, "tcplock");
+    initlock(&keylock, "tcpkey");
+    tcp_hash_set(tcp_hash_boot, TCP_HASH_MIN);
+    tcp_cb_cache = kmem_cache_create("tcp_cb", sizeof(struct tcp_cb));
+    tcp_req_cache = kmem_cache_create("tcp_req", sizeof(struct tcp_req));
+    tcp_tw_cache = kmem_cache_create("tcp_tw", sizeof(struct tcp_tw));
+    if (!tcp_cb_cache || !tcp_req_cache || !tcp_tw_cache) {
+        return -1;
+    }
+    tcp_syncookie_secret = (uint32_t)random();
     ip_add_protocol(IP_PROTOCOL_TCP, tcp_rx);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include "types.h"
+#include "defs.h"
+#include "tcp_cong.h"
+
+#define TCP_CONG_HZ 100 /* timer ticks per second */
+
+static void
+tcp_slow_start (struct tcp_cong *cc, uint32_t acked) {
+    cc->cwnd += MIN(acked, cc->mss);
+}
+
+/*
+ * NewReno (RFC 5681): one segment per RTT in congestion avoidance,
+ * half the flight on loss.
+ */
+
+static void
+newreno_init (struct tcp_cong *cc) {
+}
+
+static void
+newreno_cong_avoid (struct tcp_cong *cc, uint32_t acked, uint32_t srtt) {
+    if (cc->cwnd < cc->ssthresh) {
+        tcp_slow_start(cc, acked);
+        return;
+    }
+    cc->cwnd += MAX(1, cc->mss * cc->mss / cc->cwnd);
+}
+
+static uint32_t
+newreno_ssthresh (struct tcp_cong *cc, uint32_t inflight) {
+    return MAX(inflight / 2, 2 * cc->mss);
+}
+
+/*
+ * CUBIC (RFC 8312). The window follows W(t) = C(t - K)^3 + W_max from
+ * the last loss, but never grows slower than standard TCP would.
+ * Time is kept in 1/1024 s and constants are scaled by 1024 so that
+ * everything stays in integers without 64-bit division.
+ */
+
+#define CUBIC_BETA     717         /* 0.7 */
+#define CUBIC_C        410         /* 0.4 */
+#define CUBIC_K_FACTOR 2681735677U /* 2^40 / CUBIC_C */
+#define CUBIC_ALPHA    542         /* 3(1 - beta) / (1 + beta) */
+#define CUBIC_T_MAX    (1 << 17)   /* keeps (t - K)^3 * C within 64 bits */
+
+static uint32_t
+cubic_root (uint64_t a) {
+    uint32_t lo = 0, hi = 1 << 21, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if ((uint64_t)mid * mid * mid <= a) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+static void
+cubic_init (struct tcp_cong *cc) {
+    memset(&cc->u.cubic, 0, sizeof(cc->u.cubic));
+}
+
+static void
+cubic_cong_avoid (struct tcp_cong *cc, uint32_t acked, uint32_t srtt) {
+    uint32_t w, t, target, est, num;
+    uint64_t d, delta;
+
+    if (cc->cwnd < cc->ssthresh) {
+        tcp_slow_start(cc, acked);
+        return;
+    }
+    w = cc->cwnd / cc->mss;
+    if (!cc->u.cubic.epoch) {
+        cc->u.cubic.epoch = ticks ? ticks : 1;
+        cc->u.cubic.cnt = 0;
+        if (w < cc->u.cubic.w_max) {
+            cc->u.cubic.k = cubic_root((uint64_t)(cc->u.cubic.w_max - w) * CUBIC_K_FACTOR);
+        } else {
+            cc->u.cubic.k = 0;
+            cc->u.cubic.w_max = w;
+        }
+    }
+    /* where the curve will be one RTT from now */
+    t = ((ticks - cc->u.cubic.epoch + srtt) << 10) / TCP_CONG_HZ;
+    d = t > cc->u.cubic.k ? t - cc->u.cubic.k : cc->u.cubic.k - t;
+    d = MIN(d, (uint64_t)CUBIC_T_MAX);
+    delta = (CUBIC_C * d * d * d) >> 40;
+    if (t > cc->u.cubic.k) {
+        target = cc->u.cubic.w_max + (uint32_t)delta;
+    } else {
+        target = delta < cc->u.cubic.w_max ? cc->u.cubic.w_max - (uint32_t)delta : 0;
+    }
+    /* TCP-friendly region: what standard TCP would have by now */
+    if (srtt) {
+        est = (cc->u.cubic.w_max * CUBIC_BETA >> 10) +
+              ((ticks - cc->u.cubic.epoch) * CUBIC_ALPHA >> 10) / srtt;
+        target = MAX(target, est);
+    }
+    if (target > w) {
+        /* target - w more segments over the next RTT, at most doubling */
+        num = MIN(target - w, w);
+        cc->u.cubic.cnt += acked * num;
+    } else {
+        /* plateau: creep up by one segment per 100 RTTs */
+        cc->u.cubic.cnt += acked / 100;
+    }
+    while (cc->u.cubic.cnt >= cc->cwnd) {
+        cc->u.cubic.cnt -= cc->cwnd;
+        cc->cwnd += cc->mss;
+    }
+}
+
+static uint32_t
+cubic_ssthresh (struct tcp_cong *cc, uint32_t inflight) {
+    uint32_t w;
+
+    w = cc->cwnd / cc->mss;
+    if (w < cc->u.cubic.w_last) {
+        /* fast convergence: release bandwidth to newer flows */
+        cc->u.cubic.w_max = w * (1024 + CUBIC_BETA) >> 11;
+    } else {
+        cc->u.cubic.w_max = w;
+    }
+    cc->u.cubic.w_last = w;
+    cc->u.cubic.epoch = 0;
+    return MAX(cc->cwnd * CUBIC_BETA >> 10, 2 * cc->mss);
+}
+
+static struct tcp_cong_ops tcp_cong_table[] = {
+    { "newreno", newreno_init, newreno_cong_avoid, newreno_ssthresh },
+    { "cubic",   cubic_init,   cubic_cong_avoid,   cubic_ssthresh   },
+};
+
+/* The first entry is the default for new sockets. */
+struct tcp_cong_ops *
+tcp_cong_default (void) {
+    return &tcp_cong_table[0];
+}
+
+struct tcp_cong_ops *
+tcp_cong_find (const char *name) {
+    int i;
+
+    for (i = 0; i < NELEM(tcp_cong_table); i++) {
+        if (strncmp(tcp_cong_table[i].name, name, TCP_CONG_NAME_MAX) == 0) {
+            return &tcp_cong_table[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,34 @@
+/*
+ * TCP congestion control
+ *
+ * tcp.c owns loss detection and recovery (slow start threshold on
+ * loss, fast retransmit after three duplicate ACKs, NewReno partial
+ * ACK handling, RTO collapse to one segment). An algorithm only
+ * decides how the window grows on new ACKs and where the slow start
+ * threshold goes when a loss is detected.
+ */
+#define TCP_CONG_NAME_MAX 16
+
+struct tcp_cong {
+    uint32_t cwnd;     /* bytes */
+    uint32_t ssthresh; /* bytes */
+    uint32_t mss;
+    union {
+        struct {
+            uint32_t epoch;   /* ticks when the current growth epoch began, 0 if none */
+            uint32_t w_max;   /* window before the last loss, in segments */
+            uint32_t w_last;  /* w_max before that, for fast convergence */
+            uint32_t k;       /* time to regrow to w_max, 1/1024 s */
+            uint32_t cnt;     /* bytes acked toward the next increase */
+        } cubic;
+    } u;
+};
+
+struct tcp_cong_ops {
+    char name[TCP_CONG_NAME_MAX];
+    void (*init)(struct tcp_cong *cc);
+    /* new data acked outside recovery; srtt in ticks, 0 if unknown */
+    void (*cong_avoid)(struct tcp_cong *cc, uint32_t acked, uint32_t srtt);
+    /* a loss was detected with inflight bytes outstanding; returns the new ssthresh */
+    uint32_t (*ssthresh)(struct tcp_cong *cc, uint32_t inflight);
+};
@@ -0,0 +1,220 @@
+// Kernel timers.
+//
+// A timer calls fn(arg) once, on the first tick at or after its expiry,
+// from the "softtimer" kernel thread.  Timers are kept on a hierarchical
+// timing wheel: the first level has a slot for each of the next 256
+// ticks and each of the four levels above it spans 64 times the one
+// below.  Arming and cancelling touch a single slot list, whatever the
+// number of timers.  Timers further out sit in a coarse slot and move
+// down a level whenever the level below wraps around, at most four
+// times in their life.
+//
+// Callbacks run in process context without the wheel lock, so they may
+// take the locks of the structures they belong to and re-arm their own
+// timer.  Every other timer waits behind them, so they must not block.
+//
+// Once a callback has been taken off the wheel, timer_cancel() can no
+// longer stop it and returns 0.  A timer's owner must not free it then;
+// the usual way out is for the callback to drop a reference, or to
+// notice that its object is gone and free it itself.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "timer.h"
+
+#define TVR_BITS   8
+#define TVN_BITS   6
+#define TVR_SIZE   (1 << TVR_BITS)
+#define TVN_SIZE   (1 << TVN_BITS)
+#define TVR_MASK   (TVR_SIZE - 1)
+#define TVN_MASK   (TVN_SIZE - 1)
+#define TVN_LEVELS 4  // TVR_BITS + TVN_LEVELS*TVN_BITS == 32
+
+#define TIMER_MAX  (1U << 30)  // longest timeout, so that expiry compares stay signed
+
+static struct {
+  struct spinlock lock;
+  uint clk;                                // next tick to run
+  struct timer *tv1[TVR_SIZE];
+  struct timer *tvn[TVN_LEVELS][TVN_SIZE];
+} wheel;
+
+static void
+timer_link(struct timer **head, struct timer *t)
+{
+  t->next = *head;
+  if(t->next)
+    t->next->pprev = &t->next;
+  *head = t;
+  t->pprev = head;
+}
+
+static void
+timer_unlink(struct timer *t)
+{
+  *t->pprev = t->next;
+  if(t->next)
+    t->next->pprev = t->pprev;
+  t->next = 0;
+  t->pprev = 0;
+}
+
+// Put t in the slot for its expiry. Caller holds wheel.lock.
+static void
+timer_enqueue(struct timer *t)
+{
+  uint expire, delta;
+  int i, shift;
+
+  expire = t->expire;
+  if((int)(expire - wheel.clk) < 0)
+    expire = wheel.clk;  // overdue: run on the next tick
+  delta = expire - wheel.clk;
+  if(delta < TVR_SIZE){
+    timer_link(&wheel.tv1[expire & TVR_MASK], t);
+    return;
+  }
+  for(i = 0; i < TVN_LEVELS - 1; i++){
+    if(delta < 1U << (TVR_BITS + (i+1)*TVN_BITS))
+      break;
+  }
+  shift = TVR_BITS + i*TVN_BITS;
+  timer_link(&wheel.tvn[i][(expire >> shift) & TVN_MASK], t);
+}
+
+// Move the timers of one slot of a level down to where they now belong.
+// Returns the slot index. Caller holds wheel.lock.
+static int
+timer_cascade(int level)
+{
+  struct timer *t, *list;
+  int idx;
+
+  idx = (wheel.clk >> (TVR_BITS + level*TVN_BITS)) & TVN_MASK;
+  list = wheel.tvn[level][idx];
+  wheel.tvn[level][idx] = 0;
+  while((t = list) != 0){
+    list = t->next;
+    t->next = 0;
+    t->pprev = 0;
+    timer_enqueue(t);
+  }
+  return idx;
+}
+
+// Run every timer that is due by now.
+static void
+timer_run(void)
+{
+  struct timer *t, *list;
+  void (*fn)(void*);
+  void *arg;
+  int i;
+
+  acquire(&wheel.lock);
+  while((int)(ticks - wheel.clk) >= 0){
+    if((wheel.clk & TVR_MASK) == 0){
+      for(i = 0; i < TVN_LEVELS && timer_cascade(i) == 0; i++)
+        ;
+    }
+    // Take the slot as a whole, so that a callback re-arming its
+    // timer for now lands in the next tick's slot rather than here.
+    list = wheel.tv1[wheel.clk & TVR_MASK];
+    wheel.tv1[wheel.clk & TVR_MASK] = 0;
+    if(list)
+      list->pprev = &list;
+    wheel.clk++;
+    while((t = list) != 0){
+      timer_unlink(t);
+      fn = t->fn;
+      arg = t->arg;
+      release(&wheel.lock);
+      fn(arg);
+      acquire(&wheel.lock);
+    }
+  }
+  release(&wheel.lock);
+}
+
+static void
+timer_thread(void *arg)
+{
+  for(;;){
+    acquire(&tickslock);
+    while((int)(ticks - wheel.clk) < 0)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+    timer_run();
+  }
+}
+
+void
+timerinit(void)
+{
+  initlock(&wheel.lock, "timer");
+  wheel.clk = ticks;
+}
+
+void
+timerstart(void)
+{
+  if(kthread_create(timer_thread, 0, "softtimer") == -1)
+    panic("timerstart");
+}
+
+void
+timer_init(struct timer *t, void (*fn)(void*), void *arg)
+{
+  t->next = 0;
+  t->pprev = 0;
+  t->expire = 0;
+  t->fn = fn;
+  t->arg = arg;
+}
+
+// Arm t to fire timeout ticks from now, moving it if it is already
+// armed. Returns 1 if it was armed before, 0 if not.
+int
+timer_arm(struct timer *t, uint timeout)
+{
+  int armed;
+
+  if(timeout > TIMER_MAX)
+    timeout = TIMER_MAX;
+  acquire(&wheel.lock);
+  armed = t->pprev != 0;
+  if(armed)
+    timer_unlink(t);
+  t->expire = ticks + timeout;
+  timer_enqueue(t);
+  release(&wheel.lock);
+  return armed;
+}
+
+// Disarm t. Returns 1 if it was armed, 0 if it had already fired
+// or was never armed.
+int
+timer_cancel(struct timer *t)
+{
+  int armed;
+
+  acquire(&wheel.lock);
+  armed = t->pprev != 0;
+  if(armed)
+    timer_unlink(t);
+  release(&wheel.lock);
+  return armed;
+}
+
+int
+timer_pending(struct timer *t)
+{
+  int armed;
+
+  acquire(&wheel.lock);
+  armed = t->pprev != 0;
+  release(&wheel.lock);
+  return armed;
+}
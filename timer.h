@@ -0,0 +1,14 @@
+// Kernel timers; see timer.c.
+
+#define TIMER_HZ 100  // ticks per second (lapic timer)
+
+// Milliseconds to ticks, rounded up so that a timer never fires early.
+#define MSEC2TICKS(ms) (((ms) * TIMER_HZ + 999) / 1000)
+
+struct timer {
+  struct timer *next;    // on a wheel slot
+  struct timer **pprev;  // whatever points at this timer; 0 when not armed
+  uint expire;           // ticks
+  void (*fn)(void*);
+  void *arg;
+};
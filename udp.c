@@ -6,10 +6,10 @@
 #include "spinlock.h"
 #include "common.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ip.h"
 #include "socket.h"
 
-#define UDP_CB_TABLE_SIZE 16
 #define UDP_SOURCE_PORT_MIN 49152
 #define UDP_SOURCE_PORT_MAX 65535
 
@@ -20,6 +20,7 @@ struct udp_hdr {
     uint16_t sum;
 };
 
+/* written over the UDP header of a queued datagram */
 struct udp_queue_hdr {
     ip_addr_t addr;
     uint16_t port;
@@ -28,14 +29,16 @@ struct udp_queue_hdr {
 };
 
 struct udp_cb {
-    int used;
+    struct udp_cb *next;
+    int desc;
     struct netif *iface;
     uint16_t port;
     struct queue_head queue;
 };
 
 static struct spinlock udplock;
-static struct udp_cb cb_table[UDP_CB_TABLE_SIZE];
+static struct udp_cb *udp_cbs;          /* every open socket */
+static struct desc_table udp_descs;     /* socket descriptor -> cb */
 
 void
 udp_dump (struct netif *netif, uint8_t *packet, size_t plen) {
@@ -55,17 +58,27 @@ udp_dump (struct netif *netif, uint8_t *packet, size_t plen) {
 
 static ssize_t
 udp_tx (struct netif *iface, uint16_t sport, uint8_t *buf, size_t len, ip_addr_t *peer, uint16_t port) {
-    char packet[65536];
+    struct pbuf *pb;
     struct udp_hdr *hdr;
     ip_addr_t self;
     uint32_t pseudo = 0;
 
-    hdr = (struct udp_hdr *)packet;
+    if (len > IP_PAYLOAD_SIZE_MAX - sizeof(struct udp_hdr)) {
+        return -1;
+    }
+    pb = pbuf_alloc();
+    if (!pb) {
+        return -1;
+    }
+    hdr = (struct udp_hdr *)pbuf_put(pb, sizeof(struct udp_hdr));
     hdr->sport = sport;
     hdr->dport = port;
     hdr->len = hton16(sizeof(struct udp_hdr) + len);
     hdr->sum = 0;
-    memcpy(hdr + 1, buf, len);
+    if (pbuf_append(pb, buf, len) == -1) {
+        pbuf_free(pb);
+        return -1;
+    }
     self = ((struct netif_ip *)iface)->unicast;
     pseudo += (self >> 16) & 0xffff;
     pseudo += self & 0xffff;
@@ -73,26 +86,31 @@ udp_tx (struct netif *iface, uint16_t sport, uint8_t *buf, size_t len, ip_addr_t
     pseudo += *peer & 0xffff;
     pseudo += hton16((uint16_t)IP_PROTOCOL_UDP);
     pseudo += hton16(sizeof(struct udp_hdr) + len);
-    hdr->sum = cksum16((uint16_t *)hdr, sizeof(struct udp_hdr) + len, pseudo);
+    hdr->sum = pbuf_cksum16(pb, pseudo);
 #ifdef DEBUG
     cprintf(">>> udp_tx <<<\n");
-    udp_dump((struct netif *)iface, (uint8_t *)packet, sizeof(struct udp_hdr) + len);
+    udp_dump((struct netif *)iface, pb->data, pb->len);
 #endif
-    return ip_tx(iface, IP_PROTOCOL_UDP, (uint8_t *)packet, sizeof(struct udp_hdr) + len, peer);
+    if (ip_tx(iface, IP_PROTOCOL_UDP, pb, peer) == -1) {
+        return -1;
+    }
+    return len;
 }
 
 static void
-udp_rx (uint8_t *buf, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *iface) {
+udp_rx (struct pbuf *pb, ip_addr_t *src, ip_addr_t *dst, struct netif *iface) {
     struct udp_hdr *hdr;
     uint32_t pseudo = 0;
     struct udp_cb *cb;
-    void *data;
     struct udp_queue_hdr *queue_hdr;
+    size_t len = pb->len;
+    uint16_t sport;
 
     if (len < sizeof(struct udp_hdr)) {
+        pbuf_free(pb);
         return;
     }
-    hdr = (struct udp_hdr *)buf;
+    hdr = (struct udp_hdr *)pb->data;
     pseudo += *src >> 16;
     pseudo += *src & 0xffff;
     pseudo += *dst >> 16;
@@ -101,32 +119,34 @@ udp_rx (uint8_t *buf, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *
     pseudo += hton16(len);
     if (cksum16((uint16_t *)hdr, len, pseudo) != 0) {
         cprintf("udp checksum error\n");
+        pbuf_free(pb);
         return;
     }
 #ifdef DEBUG
     cprintf(">>> udp_rx <<<\n");
-    udp_dump((struct netif *)iface, buf, len);
+    udp_dump((struct netif *)iface, pb->data, len);
 #endif
     acquire(&udplock);
-    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-        if (cb->used && (!cb->iface || cb->iface == iface) && cb->port == hdr->dport) {
-            data = (void*)kalloc();
-            if (!data) {
+    for (cb = udp_cbs; cb; cb = cb->next) {
+        if ((!cb->iface || cb->iface == iface) && cb->port == hdr->dport) {
+            /* queue the received buffer itself; recvfrom copies it out */
+            sport = hdr->sport;
+            queue_hdr = (struct udp_queue_hdr *)hdr;
+            queue_hdr->addr = *src;
+            queue_hdr->port = sport;
+            queue_hdr->len = len - sizeof(struct udp_hdr);
+            if (!queue_push(&cb->queue, pb, len)) {
                 release(&udplock);
+                pbuf_free(pb);
                 return;
             }
-            queue_hdr = data;
-            queue_hdr->addr = *src;
-            queue_hdr->port = hdr->sport;
-            queue_hdr->len = len - sizeof(struct udp_hdr);
-            memcpy(queue_hdr + 1, hdr + 1, len - sizeof(struct udp_hdr));
-            queue_push(&cb->queue, data, sizeof(struct udp_queue_hdr) + (len - sizeof(struct udp_hdr)));
             wakeup(cb);
             release(&udplock);
             return;
         }
     }
     release(&udplock);
+    pbuf_free(pb);
     // icmp_send_destination_unreachable();
 }
 
@@ -134,41 +154,45 @@ int
 udp_api_open (void) {
     struct udp_cb *cb;
 
+    cb = (struct udp_cb *)kmalloc(sizeof(*cb));
+    if (!cb) {
+        return -1;
+    }
+    memset(cb, 0, sizeof(*cb));
     acquire(&udplock);
-    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-        if (!cb->used) {
-            cb->used = 1;
-            release(&udplock);
-            return array_offset(cb_table, cb);
-        }
+    cb->desc = desc_alloc(&udp_descs, cb);
+    if (cb->desc == -1) {
+        release(&udplock);
+        kmfree(cb);
+        return -1;
     }
+    cb->next = udp_cbs;
+    udp_cbs = cb;
     release(&udplock);
-    return -1;
+    return cb->desc;
 }
 
 int
 udp_api_close (int soc) {
-    struct udp_cb *cb;
+    struct udp_cb *cb, **p;
     struct queue_entry *entry;
 
-    if (soc < 0 || soc >= UDP_CB_TABLE_SIZE) {
-        return -1;
-    }
     acquire(&udplock);
-    cb = &cb_table[soc];
-    if (!cb->used) {
+    cb = desc_get(&udp_descs, soc);
+    if (!cb) {
         release(&udplock);
         return -1;
     }
-    cb->used = 0;
-    cb->iface = NULL;
-    cb->port = 0;
+    desc_free(&udp_descs, soc);
+    for (p = &udp_cbs; *p != cb; p = &(*p)->next)
+        ;
+    *p = cb->next;
+    release(&udplock);
     while ((entry = queue_pop(&cb->queue)) != NULL) {
-        kfree((char*)entry->data);
-        kfree((char*)entry);
+        pbuf_free((struct pbuf *)entry->data);
+        kmfree(entry);
     }
-    cb->queue.next = cb->queue.tail = NULL;
-    release(&udplock);
+    kmfree(cb);
     return 0;
 }
 
@@ -178,16 +202,13 @@ udp_api_bind (int soc, struct sockaddr *addr, int addrlen) {
     struct udp_cb *cb, *tmp;
     struct netif *iface = NULL;
 
-    if (soc < 0 || soc >= UDP_CB_TABLE_SIZE) {
-        return -1;
-    }
     if (addr->sa_family != AF_INET) {
         return -1;
     }
     sin = (struct sockaddr_in *)addr;
     acquire(&udplock);
-    cb = &cb_table[soc];
-    if (!cb->used) {
+    cb = desc_get(&udp_descs, soc);
+    if (!cb) {
         release(&udplock);
         return -1;
     }
@@ -198,8 +219,8 @@ udp_api_bind (int soc, struct sockaddr *addr, int addrlen) {
             return -1;
         }
     }
-    for (tmp = cb_table; tmp < array_tailof(cb_table); tmp++) {
-        if (tmp->used && tmp != cb && (!iface || !tmp->iface || tmp->iface == iface) && tmp->port == sin->sin_port) {
+    for (tmp = udp_cbs; tmp; tmp = tmp->next) {
+        if (tmp != cb && (!iface || !tmp->iface || tmp->iface == iface) && tmp->port == sin->sin_port) {
             release(&udplock);
             return -1;
         }
@@ -214,17 +235,14 @@ int
 udp_api_bind_iface (int soc, struct netif *iface, uint16_t port) {
     struct udp_cb *cb, *tmp;
 
-    if (soc < 0 || soc >= UDP_CB_TABLE_SIZE) {
-        return -1;
-    }
     acquire(&udplock);
-    cb = &cb_table[soc];
-    if (!cb->used) {
+    cb = desc_get(&udp_descs, soc);
+    if (!cb) {
         release(&udplock);
         return -1;
     }
-    for (tmp = cb_table; tmp < array_tailof(cb_table); tmp++) {
-        if (tmp->used && tmp != cb && (!iface || !tmp->iface || tmp->iface == iface) && tmp->port == port) {
+    for (tmp = udp_cbs; tmp; tmp = tmp->next) {
+        if (tmp != cb && (!iface || !tmp->iface || tmp->iface == iface) && tmp->port == port) {
             release(&udplock);
             return -1;
         }
@@ -242,11 +260,9 @@ udp_api_recvfrom (int soc, uint8_t *buf, size_t size, struct sockaddr *addr, int
     struct queue_entry *entry;
     int ret = 0;
     ssize_t len;
+    struct pbuf *pb;
     struct udp_queue_hdr *queue_hdr;
 
-    if (soc < 0 || soc >= UDP_CB_TABLE_SIZE) {
-        return -1;
-    }
     if (addr) {
         if (*addrlen < sizeof(struct sockaddr_in)) {
             return -1;
@@ -255,8 +271,8 @@ udp_api_recvfrom (int soc, uint8_t *buf, size_t size, struct sockaddr *addr, int
         peer = (struct sockaddr_in *)addr;
     }
     acquire(&udplock);
-    cb = &cb_table[soc];
-    if (!cb->used) {
+    cb = desc_get(&udp_descs, soc);
+    if (!cb) {
         release(&udplock);
         return -1;
     }
@@ -264,7 +280,8 @@ udp_api_recvfrom (int soc, uint8_t *buf, size_t size, struct sockaddr *addr, int
         sleep(cb, &udplock);
     }
     release(&udplock);
-    queue_hdr = (struct udp_queue_hdr *)entry->data;
+    pb = (struct pbuf *)entry->data;
+    queue_hdr = (struct udp_queue_hdr *)pb->data;
     if (peer) {
         peer->sin_family = AF_INET;
         peer->sin_addr = queue_hdr->addr;
@@ -272,8 +289,8 @@ udp_api_recvfrom (int soc, uint8_t *buf, size_t size, struct sockaddr *addr, int
     }
     len = MIN(size, queue_hdr->len);
     memcpy(buf, queue_hdr + 1, len);
-    kfree((char*)entry->data);
-    kfree((char*)entry);
+    pbuf_free(pb);
+    kmfree(entry);
     return len;
 }
 
@@ -285,18 +302,14 @@ udp_api_sendto (int soc, uint8_t *buf, size_t len, struct sockaddr *addr, int ad
     uint32_t p;
     uint16_t sport;
 
-    if (soc < 0 || soc >= UDP_CB_TABLE_SIZE) {
-        cprintf("A");
-        return -1;
-    }
     if (!addr || addr->sa_family != AF_INET || addrlen < sizeof(struct sockaddr_in)) {
         cprintf("B");
         return -1;
     }
     peer = (struct sockaddr_in *)addr;
     acquire(&udplock);
-    cb = &cb_table[soc];
-    if (!cb->used) {
+    cb = desc_get(&udp_descs, soc);
+    if (!cb) {
         cprintf("C");
         release(&udplock);
         return -1;
@@ -312,12 +325,12 @@ udp_api_sendto (int soc, uint8_t *buf, size_t len, struct sockaddr *addr, int ad
     }
     if (!cb->port) {
         for (p = UDP_SOURCE_PORT_MIN; p <= UDP_SOURCE_PORT_MAX; p++) {
-            for (tmp = cb_table; tmp < array_tailof(cb_table); tmp++) {
+            for (tmp = udp_cbs; tmp; tmp = tmp->next) {
                 if (tmp->port == hton16((uint16_t)p) && (!tmp->iface || tmp->iface == iface)) {
                     break;
                 }
             }
-            if (tmp == array_tailof(cb_table)) {
+            if (!tmp) {
                 cb->port = hton16((uint16_t)p);
                 break;
             }
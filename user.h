@@ -35,6 +35,7 @@ int recv(int, char*, int);
 int send(int, char*, int);
 int recvfrom(int, char*, int, struct sockaddr*, int*);
 int sendto(int, char*, int, struct sockaddr*, int);
+int setsockopt(int, int, int, void*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);